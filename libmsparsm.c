@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ms.h"
+#include "msparsm.h"
+
+#define SITESINC 10
+
+struct msparsm_params {
+    struct params pars;
+    unsigned short seeds[3];
+    int next; // index of the next replicate
+};
+
+/*
+ * Reads the values following -seeds, if any. Unlike commandlineseed, nothing is printed: the caller already knows
+ * the seeds it passed.
+ */
+static void readSeeds(int argc, char *argv[], unsigned short seedv[3])
+{
+    int i;
+
+    for (i = 3; i < argc - 3; i++) {
+        if (strcmp(argv[i], "-seeds") == 0) {
+            seedv[0] = atoi(argv[i + 1]);
+            seedv[1] = atoi(argv[i + 2]);
+            seedv[2] = atoi(argv[i + 3]);
+            return;
+        }
+    }
+}
+
+struct msparsm_params *msparsm_create_params(int argc, char *argv[])
+{
+    int howmany;
+    struct msparsm_params *params;
+
+    if (!checkpars(argc, argv)) // the errors are on stderr
+        return NULL;
+
+    params = malloc(sizeof(struct msparsm_params));
+    params->pars = getpars(argc, argv, &howmany, 0, 0);
+    if (params->pars.mp.treeflag == TREES_BIN) // replicates hand out Newick trees
+        params->pars.mp.treeflag = TREES_TEXT;
+    params->seeds[0] = 0x330E; // same default as the executable
+    params->seeds[1] = 0xABCD;
+    params->seeds[2] = 0x1234;
+    if (params->pars.commandlineseedflag)
+        readSeeds(argc, argv, params->seeds);
+    params->next = 0;
+
+    return params;
+}
+
+int msparsm_simulate(struct msparsm_params *params, int howmany, msparsm_callback callback, void *data)
+{
+    int i, j, stop = 0;
+    double tmrca, ttot;
+    char **gametes;
+    struct params pars = params->pars;
+    struct gensam_result gensamResults;
+    struct msparsm_replicate replicate;
+
+    replicate.nsam = pars.cp.nsam;
+    replicate.probss = 0.0;
+    ranseed(params->seeds);
+    for (i = 0; i < howmany && !stop; i++) {
+        replicate.index = params->next++;
+        ranstream(pars.firstreplicate + replicate.index);
+
+        // gensam grows the gametes when it needs more than SITESINC sites, always leaving room for the terminator
+        if (pars.mp.segsitesin == 0)
+            gametes = cmatrix(pars.cp.nsam, SITESINC + 1);
+        else
+            gametes = cmatrix(pars.cp.nsam, pars.mp.segsitesin + 1);
+
+        gensamResults = gensam(gametes, &replicate.probss, &tmrca, &ttot, pars, &replicate.segsites);
+
+        for (j = 0; j < pars.cp.nsam; j++)
+            gametes[j][replicate.segsites] = '\0';
+
+        replicate.positions = gensamResults.positions;
+        replicate.haplotypes = gametes;
+        replicate.trees = pars.mp.treeflag ? gensamResults.tree : NULL;
+
+        stop = callback(&replicate, data);
+
+        if (pars.mp.treeflag)
+            free(gensamResults.tree);
+        free(gensamResults.positions);
+        for (j = 0; j < pars.cp.nsam; j++)
+            free(gametes[j]);
+        free(gametes);
+    }
+
+    return i;
+}
+
+void msparsm_set_threads(struct msparsm_params *params, int threads)
+{
+    params->pars.mp.threads = threads < 1 ? 1 : threads;
+}
+
+void msparsm_free_params(struct msparsm_params *params)
+{
+    if (params == NULL)
+        return;
+    freepars(&params->pars);
+    free(params);
+}
@@ -102,8 +102,10 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <limits.h>
 #include "ms.h"
-#include "mspar.h"
 
 #define SITESINC 10
 
@@ -115,6 +117,7 @@ struct segl {
 
 double ran1();
 
+#ifndef MSPARSM_LIBRARY
 int main(int argc, char *argv[]){
 	int ntbs;
 	int count;
@@ -127,6 +130,12 @@ int main(int argc, char *argv[]){
 	int samples;
 	char *workerOutput, *results, *singleResult;
 
+	/* server mode: runs are requested afterwards, see serve() */
+	if( argc == 3 && strcmp( argv[1], "-server" ) == 0 ) {
+		serve(argc, argv, SITESINC);
+		return 0;
+	}
+
 	ntbs = 0 ;   /* these next few lines are for reading in parameters from a file (for each sample) */
 	tbsparamstrs = (char **)malloc( argc*sizeof(char *) ) ;
 
@@ -140,6 +149,7 @@ int main(int argc, char *argv[]){
 	// Master-Worker
 	masterWorker(argc, argv, howmany, pars, SITESINC);
 }
+#endif
 
 struct gensam_result
 gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct params pars, int *ns)
@@ -151,13 +161,15 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 	struct segl *seglst, *segtre_mig(struct c_params *p, int *nsegs ) ; /* used to be: [MAXSEG];  */
 	double nsinv,  tseg, tt, ttime(struct node *, int nsam), ttimemf(struct node *, int nsam, int mfreq) ;
 	double *pk;
-	int *ss;
-	int segsitesin,nsites;
+	int *ss, *segs;
+	int segsitesin,nsites, showsites;
+	char *out;
 	double theta, es ;
 	int nsam, mfreq ;
-	char *prtree( struct node *ptree, int nsam);
 	void make_gametes(int nsam, int mfreq,  struct node *ptree, double tt, int newsites, int ns, char **list );
 	void ndes_setup( struct node *, int nsam );
+	void mutate_segments( int nsam, int mfreq, struct segl *seglst, int *segs, int nsegs, int nsites, double *tts,
+			int *ss, char **list, double *posit, int threads );
 	struct gensam_result result;
 
 	if( pars.mp.segsitesin ==  0 ) {
@@ -181,23 +193,28 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 	mfreq = pars.mp.mfreq ;
 
 	if( pars.mp.treeflag ) {
+		/* Sizes first, then every tree written into one buffer. Newick trees print the sites of the segments
+		   only with recombination or gene conversion, binary trees always hold them (msbin.h says which). */
 		*ns = 0 ;
-		char *tempString;
-		char *treeOutput = malloc(3);
-		sprintf(treeOutput, "\n");
+		showsites = (pars.cp.r > 0.0 ) || (pars.cp.f > 0.0) ;
+		result.treeBytes = ( pars.mp.treeflag == TREES_BIN ) ? 0 : 1 ;
 		for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++) {
-			if( (pars.cp.r > 0.0 ) || (pars.cp.f > 0.0) ){
-				end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
-				start = seglst[seg].beg ;
-				len = end - start + 1 ;
-				asprintf(&tempString, "[%d]", len);
-				treeOutput = append(treeOutput, tempString);
-			}
-			treeOutput = append(treeOutput, prtree( seglst[seg].ptree, nsam )) ;
+			end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
+			len = end - seglst[seg].beg + 1 ;
+			if( pars.mp.treeflag == TREES_BIN ) result.treeBytes += binaryTreeLength( nsam ) ;
+			else result.treeBytes += newickLength( seglst[seg].ptree, nsam, showsites ? len : 0 ) ;
+		}
+		result.tree = out = malloc( result.treeBytes + 1 ) ;
+		if( pars.mp.treeflag != TREES_BIN ) *out++ = '\n' ;
+		for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++) {
+			end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
+			len = end - seglst[seg].beg + 1 ;
+			if( pars.mp.treeflag == TREES_BIN ) out = putBinaryTree( out, seglst[seg].ptree, nsam, len ) ;
+			else out = putNewick( out, seglst[seg].ptree, nsam, showsites ? len : 0 ) ;
 			if( (segsitesin == 0) && ( theta == 0.0 ) && ( pars.mp.timeflag == 0 ) )
 				free(seglst[seg].ptree) ;
 		}
-		result.tree = treeOutput;
+		*out = '\0' ;
 	}
 
 	if( pars.mp.timeflag ) {
@@ -220,29 +237,35 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 
 	if( (segsitesin == 0) && ( theta > 0.0)   )
 	{
+		segs = (int *)malloc((unsigned)(nsegs*sizeof(int)));
+		pk = (double *)malloc((unsigned)(nsegs*sizeof(double)));
+		ss = (int *)malloc((unsigned)(nsegs*sizeof(int)));
+		if( (segs==NULL) || (pk==NULL) || (ss==NULL) ) perror("malloc error. gensam.1");
+
 		*ns = 0 ;
 		for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++)
 		{
+			segs[k] = seg ;
 			if( mfreq > 1 ) ndes_setup( seglst[seg].ptree, nsam );
 			end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
 			start = seglst[seg].beg ;
 			len = end - start + 1 ;
 			tseg = len*(theta/nsites) ;
-			if( mfreq == 1) tt = ttime(seglst[seg].ptree, nsam);
-			else tt = ttimemf(seglst[seg].ptree, nsam, mfreq );
-			segsit = poisso( tseg*tt );
-			if( (segsit + *ns) >= maxsites )
-			{
-				maxsites = segsit + *ns + SITESINC ;
-				posit = (double *)realloc(posit, maxsites*sizeof(double) ) ;
-				biggerlist(nsam, list, maxsites) ;
-			}
-			make_gametes(nsam,mfreq,seglst[seg].ptree,tt, segsit, *ns, list );
-			free(seglst[seg].ptree) ;
-
-			locate(segsit,start*nsinv, len*nsinv,posit + *ns);
-			*ns += segsit;
+			if( mfreq == 1) pk[k] = ttime(seglst[seg].ptree, nsam);
+			else pk[k] = ttimemf(seglst[seg].ptree, nsam, mfreq );
+			ss[k] = poisso( tseg*pk[k] );
+			*ns += ss[k];
+		}
+		if( (unsigned) *ns >= maxsites )
+		{
+			maxsites = *ns + SITESINC ;
+			posit = (double *)realloc(posit, maxsites*sizeof(double) ) ;
+			biggerlist(nsam, list, maxsites) ;
 		}
+		mutate_segments(nsam, mfreq, seglst, segs, nsegs, nsites, pk, ss, list, posit, pars.mp.threads);
+		free(segs);
+		free(pk);
+		free(ss);
 	}
 	else if( segsitesin > 0 )
 	{
@@ -274,19 +297,21 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 		}
 		else
 			for( k=0; k<nsegs; k++) ss[k] = 0 ;
+		segs = (int *)malloc((unsigned)(nsegs*sizeof(int)));
+		if( segs==NULL ) perror("malloc error. gensam.3");
 		*ns = 0 ;
 		for( seg=0, k=0; k<nsegs; seg=seglst[seg].next, k++)
 		{
+			segs[k] = seg ;
 			end = ( k<nsegs-1 ? seglst[seglst[seg].next].beg -1 : nsites-1 );
 			start = seglst[seg].beg ;
 			len = end - start + 1 ;
 			tseg = len/(double)nsites;
-			make_gametes(nsam,mfreq,seglst[seg].ptree,tt*pk[k]/tseg, ss[k], *ns, list);
-
-			free(seglst[seg].ptree) ;
-			locate(ss[k],start*nsinv, len*nsinv,posit + *ns);
+			pk[k] = tt*pk[k]/tseg ;
 			*ns += ss[k] ;
 		}
+		mutate_segments(nsam, mfreq, seglst, segs, nsegs, nsites, pk, ss, list, posit, pars.mp.threads);
+		free(segs);
 		free(pk);
 		free(ss);
 	}
@@ -296,6 +321,53 @@ gensam( char **list, double *pprobss, double *ptmrca, double *pttot, struct para
 	return result;
 }
 
+/* Places the mutations of every segment: ss[k] sites on the tree of segment segs[k], whose total time is tts[k],
+   from the column that follows the sites of the previous segments. Segments do not depend on each other, so they
+   are filled concurrently, segment k drawing from substream k+1 of the replicate, hence the result does not depend
+   on the number of threads. A single segment keeps drawing from the stream of the calling thread. */
+void
+mutate_segments( int nsam, int mfreq, struct segl *seglst, int *segs, int nsegs, int nsites, double *tts,
+		int *ss, char **list, double *posit, int threads )
+{
+	int k, *offsets ;
+	struct ranstate stream ;
+	double nsinv = 1./nsites ;
+	void make_gametes(int nsam, int mfreq,  struct node *ptree, double tt, int newsites, int ns, char **list );
+
+	if( nsegs == 1 ) {
+		make_gametes(nsam, mfreq, seglst[segs[0]].ptree, tts[0], ss[0], 0, list);
+		free(seglst[segs[0]].ptree) ;
+		locate(ss[0], seglst[segs[0]].beg*nsinv, (nsites-seglst[segs[0]].beg)*nsinv, posit);
+		return;
+	}
+
+	offsets = (int *)malloc((unsigned)(nsegs*sizeof(int)));
+	if( offsets==NULL ) perror("malloc error. mutate_segments");
+	for( k=0; k<nsegs; k++) offsets[k] = ( k==0 ? 0 : offsets[k-1] + ss[k-1] ) ;
+	ransave(&stream);
+
+	#pragma omp parallel num_threads(threads) if(threads > 1)
+	{
+		int k, start, end ;
+		struct ranstate saved ;
+
+		ransave(&saved);
+		#pragma omp for schedule(dynamic, 16)
+		for( k=0; k<nsegs; k++) {
+			start = seglst[segs[k]].beg ;
+			end = ( k<nsegs-1 ? seglst[segs[k+1]].beg -1 : nsites-1 );
+			ranrestore(&stream);
+			ransubstream(k+1);
+			make_gametes(nsam, mfreq, seglst[segs[k]].ptree, tts[k], ss[k], offsets[k], list);
+			free(seglst[segs[k]].ptree) ;
+			locate(ss[k], start*nsinv, (end-start+1)*nsinv, posit + offsets[k]);
+		}
+		ranrestore(&saved);
+	}
+
+	free(offsets);
+}
+
 void
 ndes_setup(struct node *ptree, int nsam )
 {
@@ -371,6 +443,15 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 		if( *phowmany  <= 0 ) { fprintf(stderr,"Second argument error. howmany <= 0. \n"); usage();}
 		pars.commandlineseedflag = 0 ;
 		pars.output_precision = 4 ;
+		pars.outputfile = NULL ;
+		pars.resume = 0 ;
+		pars.shard = 0 ;
+		pars.shards = 1 ;
+		pars.firstreplicate = 0 ;
+		pars.walltime = 0. ;
+		pars.format = FORMAT_TEXT ;
+		pars.sitemajor = 0 ;
+		pars.gz = 0 ;
 		pars.cp.r = pars.mp.theta =  pars.cp.f = 0.0 ;
 		pars.cp.track_len = 0. ;
 		pars.cp.npop = npop = 1 ;
@@ -381,6 +462,7 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 		pars.mp.treeflag = 0 ;
 		pars.mp.timeflag = 0 ;
 		pars.mp.mfreq = 1 ;
+		pars.mp.threads = 1 ;
 		pars.cp.config = (int *) malloc( (unsigned)(( pars.cp.npop +1 ) *sizeof( int)) );
 		(pars.cp.config)[0] = pars.cp.nsam ;
 		pars.cp.size= (double *) malloc( (unsigned)( pars.cp.npop *sizeof( double )) );
@@ -401,11 +483,25 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 		if( argv[arg][0] != '-' ) { fprintf(stderr," argument should be -%s ?\n", argv[arg]); usage();}
 		switch ( argv[arg][1] ){
 			case 'f' :
-				if( ntbs > 0 ) { fprintf(stderr," can't use tbs args and -f option.\n"); exit(1); }
+				if( strcmp( argv[arg], "-format" ) == 0 ) {
+					arg++;
+					argcheck(arg,argc,argv);
+					pars.sitemajor = 0 ;
+					if( strcmp( argv[arg], "bin" ) == 0 ) pars.format = FORMAT_BIN ;
+					else if( strcmp( argv[arg], "bin-sites" ) == 0 ) { pars.format = FORMAT_BIN ; pars.sitemajor = 1 ; }
+					else if( strcmp( argv[arg], "text" ) == 0 ) pars.format = FORMAT_TEXT ;
+					else {
+						fprintf(stderr,"with -format option must specify text, bin or bin-sites\n");
+						usage();
+					}
+					arg++;
+					break;
+				}
+				if( ntbs > 0 ) { fprintf(stderr," can't use tbs args and -f option.\n"); parsexit(1); }
 				arg++;
 				argcheck( arg, argc, argv);
 				pf = fopen( argv[arg], "r" ) ;
-				if( pf == NULL ) {fprintf(stderr," no parameter file %s\n", argv[arg] ); exit(0);}
+				if( pf == NULL ) {fprintf(stderr," no parameter file %s\n", argv[arg] ); parsexit(0);}
 				arg++;
 				argc++ ;
 				argv = (char **)malloc(  (unsigned)(argc+1)*sizeof( char *) ) ;
@@ -422,6 +518,11 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 				arg = argstart ;
 				break;
 			case 'r' :
+				if( strcmp( argv[arg], "-resume" ) == 0 ) {
+					pars.resume = 1 ;
+					arg++;
+					break;
+				}
 				arg++;
 				argcheck( arg, argc, argv);
 				pars.cp.r = atof(  argv[arg++] );
@@ -432,6 +533,21 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 					usage();
 				}
 				break;
+			case 'o' :
+				arg++;
+				argcheck(arg,argc,argv);
+				pars.outputfile = argv[arg++] ;
+				break;
+			case 'w' :
+				if( strcmp( argv[arg], "-walltime" ) != 0 ) { fprintf(stderr," option default\n");  usage() ; }
+				arg++;
+				argcheck(arg,argc,argv);
+				pars.walltime = atof( argv[arg++] ) ;
+				if( pars.walltime <= 0. ) {
+					fprintf(stderr,"with -walltime option must specify seconds > 0\n");
+					usage();
+				}
+				break;
 			case 'p' :
 				arg++;
 				argcheck(arg,argc,argv);
@@ -456,7 +572,19 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 			case 's' :
 				arg++;
 				argcheck( arg, argc, argv);
-				if( argv[arg-1][2] == 'e' ){  /* command line seeds */
+				if( strcmp( argv[arg-1], "-shard" ) == 0 ) {
+					if( sscanf( argv[arg++], "%d/%d", &pars.shard, &pars.shards ) != 2
+					    || pars.shards < 1 || pars.shard < 0 || pars.shard >= pars.shards ) {
+						fprintf(stderr,"with -shard option must specify i/N, with 0 <= i < N\n");
+						usage();
+					}
+					/* shards are consecutive replicates, so that they add up to a single run */
+					if( count == 0 ) {
+						pars.firstreplicate = (long long) *phowmany * pars.shard / pars.shards ;
+						*phowmany = (long long) *phowmany * (pars.shard + 1) / pars.shards - pars.firstreplicate ;
+					}
+				}
+				else if( argv[arg-1][2] == 'e' ){  /* command line seeds */
 					pars.commandlineseedflag = 1 ;
 					// Big assumption: always 3 seeds
 					arg += 3;
@@ -475,8 +603,12 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 				}
 				break;
 			case 'T' :
-				pars.mp.treeflag = 1 ;
+				pars.mp.treeflag = TREES_TEXT ;
 				arg++;
+				if( (arg < argc) && (strcmp( argv[arg], "bin" ) == 0) ) {
+					pars.mp.treeflag = TREES_BIN ;
+					arg++;
+				}
 				break;
 			case 'I' :
 				arg++;
@@ -549,6 +681,18 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 				pars.cp.size[pop] = psize ;
 				break;
 			case 'g' :
+				if( strcmp( argv[arg], "-gz" ) == 0 ) {
+					pars.gz = 6 ;
+					arg++;
+					if( (arg < argc) && (argv[arg][0] != '-') ) {
+						pars.gz = atoi( argv[arg++] ) ;
+						if( (pars.gz < 1) || (pars.gz > 9) ) {
+							fprintf(stderr,"with -gz option the level must be 1 to 9\n");
+							usage();
+						}
+					}
+					break;
+				}
 				if( npop < 2 ) { fprintf(stderr,"Must use -I option first.\n"); usage();}
 				arg++;
 				argcheck( arg, argc, argv);
@@ -659,27 +803,67 @@ getpars(int argc, char *argv[], int *phowmany, int ntbs, int count )
 	if( (pars.mp.theta == 0.0) && ( pars.mp.segsitesin == 0 ) && ( pars.mp.treeflag == 0 ) && (pars.mp.timeflag == 0) ) {
 		fprintf(stderr," either -s or -t or -T option must be used. \n");
 		usage();
-		exit(1);
+		parsexit(1);
+	}
+	if( (pars.mp.treeflag == TREES_BIN) && (pars.format != FORMAT_BIN) ) {
+		fprintf(stderr," -T bin needs -format bin.\n");
+		usage();
+		parsexit(1);
+	}
+	if( (pars.gz > 0) && (pars.format == FORMAT_BIN) ) {
+		fprintf(stderr," -gz is for text output, not -format bin.\n");
+		usage();
+		parsexit(1);
 	}
 	sum = 0 ;
 	for( i=0; i< pars.cp.npop; i++) sum += (pars.cp.config)[i] ;
 	if( sum != pars.cp.nsam ) {
 		fprintf(stderr," sum sample sizes != nsam\n");
 		usage();
-		exit(1);
+		parsexit(1);
 	}
 
 	return pars;
 }
 
 
+/* Set while checkpars runs: errors of getpars jump back there instead of terminating the process */
+static jmp_buf *parserror = NULL ;
+
+void
+parsexit( int status )
+{
+	if( parserror != NULL ) longjmp( *parserror, 1 ) ;
+	exit( status ) ;
+}
+
+/* Parses a command line as getpars does, reporting its errors on stderr without terminating the process.
+   Returns 1 if it is valid, 0 otherwise. What getpars allocated before an error is not freed. */
+int
+checkpars( int argc, char *argv[] )
+{
+	jmp_buf error ;
+	struct params pars ;
+	int howmany ;
+
+	if( setjmp( error ) ) {
+		parserror = NULL ;
+		return 0 ;
+	}
+	parserror = &error ;
+	pars = getpars( argc, argv, &howmany, 0, 0 ) ;
+	parserror = NULL ;
+	freepars( &pars ) ;
+	return 1 ;
+}
+
 void
 argcheck( int arg, int argc, char *argv[] )
 {
 	if( (arg >= argc ) || ( argv[arg][0] == '-') ) {
 		fprintf(stderr,"not enough arguments after %s\n", argv[arg-1] ) ;
 		fprintf(stderr,"For usage type: ms<return>\n");
-		exit(0);
+		parsexit(0);
 	}
 }
 
@@ -691,6 +875,7 @@ usage()
 	fprintf(stderr,"\t -t theta   (this option and/or the next must be used. Theta = 4*N0*u )\n");
 	fprintf(stderr,"\t -s segsites   ( fixed number of segregating sites)\n");
 	fprintf(stderr,"\t -T          (Output gene tree.)\n");
+	fprintf(stderr,"\t -T bin      (Output gene trees as parents and times of the nodes, with -format bin.)\n");
 	fprintf(stderr,"\t -F minfreq     Output only sites with freq of minor allele >= minfreq.\n");
 	fprintf(stderr,"\t -r rho nsites     (rho here is 4Nc)\n");
 	fprintf(stderr,"\t\t -c f track_len   (f = ratio of conversion rate to rec rate. tracklen is mean length.) \n");
@@ -715,10 +900,18 @@ usage()
 	fprintf(stderr,"\t -ej t i j   ( Join lineages in pop i and pop j into pop j\n");
 	fprintf(stderr,"\t\t  size, alpha and M are unchanged.\n");
 	fprintf(stderr,"\t  -f filename     ( Read command line arguments from file filename.)\n");
+	fprintf(stderr,"\t  -o filename     ( Write the output to filename through MPI-IO instead of stdout.)\n");
+	fprintf(stderr,"\t  -shard i/N  ( Generate only the i-th of N shards of the replicates, 0 <= i < N.)\n");
+	fprintf(stderr,"\t  -resume     ( Go on with the run checkpointed in filename.ckpt, see -o.)\n");
+	fprintf(stderr,"\t  -format bin  ( Write packed binary records with an index instead of text, see ms2text.)\n");
+	fprintf(stderr,"\t  -format bin-sites  ( The same, with the haplotypes packed site by site instead of sample by sample.)\n");
+	fprintf(stderr,"\t  -walltime seconds  ( Start no replicate unless it is expected to end within seconds.)\n");
+	fprintf(stderr,"\t  -gz [level]  ( Write BGZF (gzip) compressed output, compressed by the workers. level 1 to 9, 6 by default.)\n");
+	fprintf(stderr,"\t  (msparsm -server socket   Serve the runs requested through a Unix domain socket.)\n");
 	fprintf(stderr,"\t  -p n ( Specifies the precision of the position output.  n is the number of digits after the decimal.)\n");
 	fprintf(stderr," See msdoc.pdf for explanation of these parameters.\n");
 
-	exit(1);
+	parsexit(1);
 }
 void
 addtoelist( struct devent *pt, struct devent *elist )
@@ -752,6 +945,20 @@ free_eventlist( struct devent *pt, int npop )
 	}
 }
 
+/* frees what getpars allocated */
+void
+freepars( struct params *pars )
+{
+	int i ;
+
+	free_eventlist( pars->cp.deventlist, pars->cp.npop );
+	for( i = 0; i < pars->cp.npop; i++) free( pars->cp.mig_mat[i] );
+	free( pars->cp.mig_mat );
+	free( pars->cp.config );
+	free( pars->cp.size );
+	free( pars->cp.alphag );
+}
+
 
 /************ make_gametes.c  *******************************************
 *
@@ -812,60 +1019,6 @@ ttimemf( ptree, nsam, mfreq)
 }
 
 
-char*
-prtree( ptree, nsam)
-		struct node *ptree;
-		int nsam;
-{
-	double t;
-	int i, *descl, *descr ;
-	char *parens( struct node *ptree, int *descl, int *descr, int noden );
-
-	descl = (int *)malloc( (unsigned)(2*nsam-1)*sizeof( int) );
-	descr = (int *)malloc( (unsigned)(2*nsam-1)*sizeof( int) );
-	for( i=0; i<2*nsam-1; i++) descl[i] = descr[i] = -1 ;
-	for( i = 0; i< 2*nsam-2; i++){
-		if( descl[ (ptree+i)->abv ] == -1 ) descl[(ptree+i)->abv] = i ;
-		else descr[ (ptree+i)->abv] = i ;
-	}
-	char *result = parens( ptree, descl, descr, 2*nsam-2);
-	free( descl ) ;
-	free( descr ) ;
-
-	return result;
-}
-
-char*
-parens( struct node *ptree, int *descl, int *descr,  int noden)
-{
-	double time ;
-	char *result = malloc(16);
-
-	if( descl[noden] == -1 )
-	{
-		sprintf(result,"%d:%5.3lf", noden+1, (ptree+ ((ptree+noden)->abv))->time );
-	}
-	else
-	{
-		sprintf(result, "(");
-		result = append(result, parens( ptree, descl,descr, descl[noden] ));
-		result = append(result, ",");
-		result = append(result, parens(ptree, descl, descr, descr[noden] )) ;
-		if( (ptree+noden)->abv == 0 )
-		{
-			result = append(result, ");\n");
-		}
-		else
-        {
-			time = (ptree + (ptree+noden)->abv )->time - (ptree+noden)->time ;
-			char* tempString = malloc(9);
-			sprintf(tempString, "):%5.3lf", time );
-			result = append(result, tempString);
-		}
-	}
-	return result;
-}
-
 /***  pickb : returns a random branch from the tree. The probability of picking
               a particular branch is proportional to its duration. tt is total
 	      time in tree.   ****/
@@ -1018,26 +1171,96 @@ poisso(double u)
 
 /* a slight modification of crecipes version */
 
+/* The second deviate of the pair is not kept for the next call: it would tie a replicate to the draws of the
+   previous one. */
 double gasdev(m,v)
 		double m, v;
 {
-	static int iset=0;
-	static float gset;
 	float fac,r,v1,v2;
 	double ran1();
 
-	if  (iset == 0) {
-		do {
-			v1=2.0*ran1()-1.0;
-			v2=2.0*ran1()-1.0;
-			r=v1*v1+v2*v2;
-		} while (r >= 1.0);
-		fac=sqrt(-2.0*log(r)/r);
-		gset= v1*fac;
-		iset=1;
-		return( m + sqrt(v)*v2*fac);
-	} else {
-		iset=0;
-		return( m + sqrt(v)*gset ) ;
-	}
+	do {
+		v1=2.0*ran1()-1.0;
+		v2=2.0*ran1()-1.0;
+		r=v1*v1+v2*v2;
+	} while (r >= 1.0);
+	fac=sqrt(-2.0*log(r)/r);
+	return( m + sqrt(v)*v2*fac);
+}
+
+/*--------------------------------------------------------------
+ *
+ *  DESCRIPTION: (Append strings)  CMS
+ *
+ *    Given two strings, lhs and rhs, the rhs string is appended
+ *    to the lhs string, which can later on can be safely accessed
+ *    by the caller of this function.
+ *
+ *  ARGUMENTS:
+ *
+ *    lhs - The left hand side string
+ *    rhs - The right hand side string
+ *
+ *  RETURNS:
+ *    A pointer to the new string (rhs appended to lhs)
+ *
+ *------------------------------------------------------------*/
+char *append(char *lhs, const char *rhs)
+{
+    const size_t len1 = strlen(lhs);
+    const size_t len2 = strlen(rhs);
+    const size_t newSize = len1 + len2 + 1; //+1 because of the terminating null
+
+    char *const buffer = malloc(newSize);
+
+    strcpy(buffer, lhs);
+    strcpy(buffer+len1, rhs);
+
+    return buffer;
+}
+
+/*--------------------------------------------------------------
+ *
+ *  DESCRIPTION: (Parse a size)
+ *
+ *    Parses a size in bytes, as taken by MSPARSM_BATCH_SIZE: a
+ *    non negative number, optionally followed by a K, M or G
+ *    suffix (e.g. "4M"), and nothing else.
+ *
+ *  ARGUMENTS:
+ *
+ *    size - The text of the size
+ *
+ *  RETURNS:
+ *    The size, or -1 when the text is not a size or the size
+ *    does not fit in a long
+ *
+ *------------------------------------------------------------*/
+long parseSize(const char *size)
+{
+    char *suffix;
+    int shift = 0;
+    long value;
+
+    errno = 0;
+    value = strtol(size, &suffix, 10);
+    if (suffix == size || errno == ERANGE || value < 0)
+        return -1;
+
+    switch (*suffix) {
+        case 'G': case 'g':
+            shift += 10;
+            /* fall through */
+        case 'M': case 'm':
+            shift += 10;
+            /* fall through */
+        case 'K': case 'k':
+            shift += 10;
+            suffix++;
+            break;
+    }
+    if (*suffix != '\0' || value > (LONG_MAX >> shift))
+        return -1;
+
+    return value << shift;
 }
@@ -27,12 +27,35 @@ struct m_params {
 	int treeflag;
 	int timeflag;
 	int mfreq;
+	int threads;	/* threads placing the mutations of the segments of a sample */
 } ;
+#define FORMAT_TEXT 0
+#define FORMAT_BIN 1
+#define TREES_TEXT 1	/* treeflag: Newick trees (-T) */
+#define TREES_BIN 2	/* treeflag: binary trees (-T bin, see mstrees.c) */
+
 struct params {
 	struct c_params cp;
 	struct m_params mp;
 	int commandlineseedflag ;
 	int output_precision;
+	char *outputfile;
+	int resume;	/* go on from the last checkpoint of the output file */
+	int shard;	/* shard of the replicates generated by this run (-shard shard/shards) */
+	int shards;
+	int firstreplicate;	/* index of the first replicate of the shard */
+	double walltime;	/* seconds after which no more replicates are started (-walltime), 0 = unbounded */
+	int format;	/* FORMAT_TEXT, or FORMAT_BIN for packed records (-format bin, see msbin.h) */
+	int sitemajor;	/* -format bin-sites: haplotypes packed site by site */
+	int gz;	/* compression level of BGZF output (-gz), 0 = uncompressed */
+};
+
+/* Random number generator of a thread (rand3.c) */
+struct ranstate {
+	unsigned int key[2];
+	unsigned int ctr[4];
+	unsigned int out[4];
+	int used;
 };
 
 struct node{
@@ -47,9 +70,52 @@ struct gensam_result {
 	double 	*positions;
 	// tree output
 	char	*tree;
+	// length of the tree output, which is binary with -T bin
+	int	treeBytes;
 };
 
 
+struct gensam_result gensam(char **gametes, double *probss, double *ptmrca, double *pttot, struct params pars, int* segsites);
+struct params getpars(int argc, char *argv[], int *howmany, int ntbs, int count);
+void freepars(struct params *pars);
+int checkpars(int argc, char *argv[]);
+void parsexit(int status);
+char *append(char *lhs, const char *rhs);
+long parseSize(const char *size);
+char **cmatrix(int nsam, int len);
+
+/* mstrees.c */
+long newickLength(struct node *ptree, int nsam, int sites);
+char *putNewick(char *out, struct node *ptree, int nsam, int sites);
+long binaryTreeLength(int nsam);
+char *putBinaryTree(char *out, struct node *ptree, int nsam, int sites);
+const char *getBinaryTree(const char *in, struct node *ptree, int nsam, int *sites);
+
+/* mspar.c, or msthreads.c in the msparsm-threads build */
+void masterWorker(int argc, char *argv[], int howmany, struct params parameters, int unsigned maxsites);
+void serve(int argc, char *argv[], unsigned int maxsites);
+
+/* msoutput.c */
+char* generateSample(struct params parameters, unsigned int maxsites, int index, int *bytes);
+char *encodeSample(int segsites, double probss, struct params pars, const char *tree, const double *positions,
+                   char **gametes, int *bytes);
+char *generateRecord(struct params parameters, unsigned maxsites, int index, int *bytes);
+char *formatRecord(const char *record, struct params parameters, int *bytes);
+struct binindex;
+char *generateBinRecord(struct params parameters, unsigned maxsites, int index, int *bytes);
+char *binHeader(const char *text, struct params parameters, long *bytes);
+void addBinRecords(struct binindex *index, const char *records, long bytes, unsigned long long offset);
+char *binIndexFooter(struct binindex *index, long *bytes);
+char *compressOutput(const char *data, long bytes, int level, long *compressed);
+char *compressedEnd(long *bytes);
+
+double ran1();
+void ranseed(unsigned short seedv[3]);
+void ranstream(unsigned long replicate);
+void ransubstream(unsigned int substream);
+void ransave(struct ranstate *saved);
+void ranrestore(const struct ranstate *saved);
+
 /*KRT -- prototypes added*/
 void ordran(int n, double pbuf[]);
 void ranvec(int n, double pbuf[]);
@@ -0,0 +1,67 @@
+// **************************************  //
+// BINARY CONTAINER FORMAT (-format bin)
+// **************************************  //
+// Replicates as packed records, which are read without parsing any text and reached at random through an index at
+// the end of the file:
+//
+//     header    char[8]   "MSPARBIN"
+//               uint32    version (BIN_VERSION)
+//               uint32    nsam
+//               uint32    precision of the positions in ms text (-p)
+//               uint32    length of the text header, followed by the text header (command line and seeds)
+//     records   one per replicate, in the order they were written, which is not the replicate order unless the
+//               output is ordered:
+//               uint32    size of the record in bytes
+//               uint32    replicate index
+//               int32     segsites
+//               uint32    flags (BIN_SEGSITES_LINE, BIN_PROB_LINE, ...)
+//               float64   probss
+//               float64   positions[segsites], on a scale of 0.0 - 1.0
+//               uint32    length of the trees, followed by the trees as printed in ms text (with -T), or the binary
+//                         trees of the segments (with -T bin, see mstrees.c)
+//               bytes     haplotypes sample by sample, (segsites + 7) / 8 bytes per sample: site j of a sample is
+//                         bit j % 8 of its byte j / 8; or, with BIN_SITE_MAJOR (-format bin-sites), site by site,
+//                         (nsam + 7) / 8 bytes per site: sample i at a site is bit i % 8 of its byte i / 8
+//     index     uint64    replicate index and offset of every record, sorted by replicate index
+//               uint64    number of records
+//               char[8]   "MSPARIDX"
+//
+// Replicate k is found by a binary search of the index, or straight at entry k - first when the indices follow each
+// other from the first one, as they do for a whole run or shard (a run cut short by -walltime may leave gaps).
+//
+// Every part starts at a multiple of 8 bytes (padded with zeros), so a mapped file can be read in place. Numbers are
+// in the byte order of the machine that wrote them. ms2text turns a file back into ms text, text2ms the other way.
+
+#ifndef MSBIN_H
+#define MSBIN_H
+
+#define BIN_MAGIC "MSPARBIN"
+#define BIN_INDEX_MAGIC "MSPARIDX"
+#define BIN_VERSION 2
+
+#define BIN_HEADER_BYTES 24  // header before the text
+#define BIN_RECORD_BYTES 24  // record before the positions
+#define BIN_TRAILER_BYTES 16 // number of records and magic, closing the index
+
+#define BIN_SEGSITES_LINE 1 // ms text prints the trees and the segsites line (segsites > 0 or theta > 0)
+#define BIN_PROB_LINE 2     // ms text prints the prob line (-s and -t)
+#define BIN_BINARY_TREES 4  // trees are binary (-T bin)
+#define BIN_TREE_SITES 8    // ms text prints the sites of the segments before binary trees (-r or -c)
+#define BIN_SITE_MAJOR 16   // haplotypes are packed site by site (-format bin-sites)
+
+#define BIN_ALIGN(bytes) (((bytes) + 7) & ~7L)
+
+// Entry of the index
+struct binentry {
+    unsigned long long replicate;
+    unsigned long long offset;
+};
+
+// Records written so far, making up the index
+struct binindex {
+    struct binentry *entries;
+    long count;
+    long capacity;
+};
+
+#endif
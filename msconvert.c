@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ms.h"
+#include "msbin.h"
+
+// **************************************  //
+// MS2TEXT / TEXT2MS
+// **************************************  //
+// Converters between ms text and the binary container written with -format bin (see msbin.h). Both are built from
+// this file: text2ms when TEXT2MS is defined, ms2text otherwise. ms2text prints the replicates in replicate order, and
+// text2ms numbers them in file order, packed sample by sample, so text converted to binary and back is unchanged.
+//
+// usage: ms2text [-o output] input
+//        text2ms [-o output] input
+
+static const char *mapInput(const char *path, off_t *size)
+{
+    struct stat status;
+    const char *data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &status) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    *size = status.st_size;
+    if (*size == 0)
+        return NULL;
+
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    madvise((void *) data, *size, MADV_SEQUENTIAL);
+    close(fd);
+
+    return data;
+}
+
+#ifndef TEXT2MS
+// Text of every byte of packed haplotypes, site j of the byte being bit j
+static char bitText[256][8];
+
+static void initBitText(void)
+{
+    int byte, j;
+
+    for (byte = 0; byte < 256; byte++)
+        for (j = 0; j < 8; j++)
+            bitText[byte][j] = byte & (1 << j) ? '1' : '0';
+}
+
+/*
+ * Prints binary trees (-T bin) as the Newick trees gensam would have printed.
+ */
+static void printBinaryTrees(const char *trees, unsigned int treeBytes, unsigned int nsam, unsigned int flags,
+                             FILE *out)
+{
+    int sites;
+    long length;
+    const char *end = trees + treeBytes;
+    char *text;
+    struct node *ptree = malloc(sizeof(struct node) * (2 * nsam - 1));
+
+    fputc('\n', out);
+    while (trees < end) {
+        trees = getBinaryTree(trees, ptree, nsam, &sites);
+        if (!(flags & BIN_TREE_SITES))
+            sites = 0;
+        length = newickLength(ptree, nsam, sites);
+        text = malloc(length + 1);
+        putNewick(text, ptree, nsam, sites);
+        fwrite(text, sizeof(char), length, out);
+        free(text);
+    }
+    free(ptree);
+}
+
+/*
+ * Prints a record as encodeSample (msoutput.c) does. Haplotypes packed sample by sample are expanded a byte, 8 sites,
+ * at a time into row, which holds at least the sites rounded up to a multiple of 8; those packed site by site are
+ * picked a bit at a time.
+ */
+static void printRecord(const char *record, unsigned int nsam, unsigned int precision, char *row, FILE *out)
+{
+    int segsites, j;
+    unsigned int i, flags, treeBytes;
+    long rowBytes, columnBytes;
+    double probss;
+    const double *positions = (const double *) (record + BIN_RECORD_BYTES);
+    const unsigned char *haplotypes;
+
+    memcpy(&segsites, record + 8, sizeof(int));
+    memcpy(&flags, record + 12, sizeof(int));
+    memcpy(&probss, record + 16, sizeof(double));
+    memcpy(&treeBytes, record + BIN_RECORD_BYTES + sizeof(double) * segsites, sizeof(int));
+    haplotypes = (const unsigned char *) record + BIN_RECORD_BYTES + sizeof(double) * segsites + sizeof(int) + treeBytes;
+    rowBytes = (segsites + 7) / 8;
+    columnBytes = (nsam + 7) / 8;
+
+    fputs("\n//", out);
+    if (!(flags & BIN_SEGSITES_LINE))
+        return;
+
+    if (flags & BIN_BINARY_TREES)
+        printBinaryTrees(record + BIN_RECORD_BYTES + sizeof(double) * segsites + sizeof(int), treeBytes, nsam, flags,
+                         out);
+    else if (treeBytes > 0)
+        fwrite(record + BIN_RECORD_BYTES + sizeof(double) * segsites + sizeof(int), sizeof(char), treeBytes, out);
+    else
+        fputc('\n', out);
+    if (flags & BIN_PROB_LINE)
+        fprintf(out, "prob: %g\n", probss);
+    fprintf(out, "segsites: %d\n", segsites);
+    if (segsites == 0)
+        return;
+
+    fputs("positions: ", out);
+    for (j = 0; j < segsites; j++)
+        fprintf(out, "%6.*lf ", precision, positions[j]);
+    fputc('\n', out);
+
+    for (i = 0; i < nsam; i++) {
+        if (flags & BIN_SITE_MAJOR) {
+            for (j = 0; j < segsites; j++)
+                row[j] = '0' + (haplotypes[j * columnBytes + (i >> 3)] >> (i & 7) & 1);
+        } else {
+            for (j = 0; j < rowBytes; j++)
+                memcpy(row + 8 * j, bitText[haplotypes[i * rowBytes + j]], 8);
+        }
+        row[segsites] = '\n';
+        fwrite(row, sizeof(char), segsites + 1, out);
+    }
+    fputc(' ', out);
+}
+
+/*
+ * ms2text: prints the text header and then every record, going through the index, i.e. in replicate order.
+ */
+static void binToText(const char *data, off_t size, FILE *out)
+{
+    unsigned int fields[4]; // version, nsam, precision, length of the text header
+    unsigned long long count, i, offset;
+    const struct binentry *index;
+    int segsites, maxSegsites = 0;
+    char *row;
+
+    if (size < BIN_HEADER_BYTES + BIN_TRAILER_BYTES || memcmp(data, BIN_MAGIC, 8) != 0
+        || memcmp(data + size - 8, BIN_INDEX_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a complete -format bin file\n");
+        exit(1);
+    }
+    memcpy(fields, data + 8, sizeof(fields));
+    if (fields[0] != BIN_VERSION) {
+        fprintf(stderr, "Unknown -format bin version %u\n", fields[0]);
+        exit(1);
+    }
+    memcpy(&count, data + size - BIN_TRAILER_BYTES, sizeof(count));
+    index = (const struct binentry *) (data + size - BIN_TRAILER_BYTES - sizeof(struct binentry) * count);
+
+    for (i = 0; i < count; i++) {
+        memcpy(&segsites, data + index[i].offset + 8, sizeof(int));
+        if (segsites > maxSegsites)
+            maxSegsites = segsites;
+    }
+    row = malloc(BIN_ALIGN(maxSegsites) + 1);
+    initBitText();
+
+    fwrite(data + BIN_HEADER_BYTES, sizeof(char), fields[3], out);
+    for (i = 0; i < count; i++) {
+        offset = index[i].offset;
+        printRecord(data + offset, fields[1], fields[2], row, out);
+    }
+
+    free(row);
+}
+
+#else
+/*
+ * Finds the next replicate boundary, the "\n//" leading every replicate (see msmerge).
+ *
+ * @return offset of the boundary, size when there is none
+ */
+static off_t nextBoundary(const char *data, off_t from, off_t size)
+{
+    const char *slash;
+
+    while (from < size && (slash = memchr(data + from, '/', size - from)) != NULL) {
+        from = slash - data;
+        if (from > 0 && data[from - 1] == '\n' && from + 1 < size && data[from + 1] == '/')
+            return from - 1;
+        from++;
+    }
+
+    return size;
+}
+
+static const char *endOfLine(const char *line, const char *end)
+{
+    const char *newline = memchr(line, '\n', end - line);
+
+    return newline != NULL ? newline : end;
+}
+
+static void writePadded(const void *data, size_t bytes, size_t padded, FILE *out)
+{
+    static const char zeros[8] = { 0 };
+
+    fwrite(data, sizeof(char), bytes, out);
+    fwrite(zeros, sizeof(char), padded - bytes, out);
+}
+
+/*
+ * text2ms: parses every replicate and writes it as a record, with the index at the end. The number of samples and
+ * the precision of the positions are those of the first replicate with segregating sites, or those of the command
+ * line when there is none.
+ */
+static void textToBin(const char *data, off_t size, FILE *out)
+{
+    off_t start = nextBoundary(data, 0, size), boundary, next;
+    unsigned int fields[4] = { BIN_VERSION, 0, 4, start };
+    struct binentry *entries = NULL;
+    unsigned long long count = 0, capacity = 0, position;
+    unsigned int replicate = 0, flags, treeBytes, recordBytes;
+    int segsites, rows, i, j;
+    double probss, *positions = NULL;
+    unsigned char *haplotypes = NULL;
+    const char *line, *eol, *end, *tree, *point;
+    char *parsed, header[BIN_HEADER_BYTES];
+    int positionsCapacity = 0;
+    long rowBytes, haplotypesCapacity = 0;
+
+    // Defaults from the command line, "<program> nsam howmany ... -p precision ..."
+    for (line = data; line < data + start && *line != ' ' && *line != '\n'; line++)
+        ;
+    if (line < data + start && *line == ' ')
+        fields[1] = strtoul(line + 1, NULL, 10);
+    for (line = data; (line = memmem(line, data + start - line, " -p ", 4)) != NULL; line += 4)
+        fields[2] = strtoul(line + 4, NULL, 10);
+
+    // The first replicate with sites tells the number of samples and the precision
+    for (boundary = start; boundary < size; boundary = nextBoundary(data, boundary + 3, size)) {
+        end = data + nextBoundary(data, boundary + 3, size);
+        line = memmem(data + boundary, end - data - boundary, "\npositions: ", 12);
+        if (line == NULL)
+            continue;
+        line += 12;
+        eol = endOfLine(line, end);
+        point = memchr(line, '.', eol - line);
+        for (fields[2] = 0; point != NULL && point + 1 + fields[2] < eol && point[1 + fields[2]] >= '0' && point[1 + fields[2]] <= '9'; fields[2]++)
+            ;
+        for (fields[1] = 0, line = eol + 1; line < end && (*line == '0' || *line == '1'); line = endOfLine(line, end) + 1)
+            fields[1]++;
+        break;
+    }
+
+    memcpy(header, BIN_MAGIC, 8);
+    memcpy(header + 8, fields, sizeof(fields));
+    fwrite(header, sizeof(char), BIN_HEADER_BYTES, out);
+    writePadded(data, start, BIN_ALIGN(BIN_HEADER_BYTES + start) - BIN_HEADER_BYTES, out);
+    position = BIN_ALIGN(BIN_HEADER_BYTES + start);
+
+    for (boundary = start; boundary < size; boundary = next) {
+        next = nextBoundary(data, boundary + 3, size);
+        end = data + next;
+        line = data + boundary + 3;
+        flags = treeBytes = 0;
+        segsites = 0;
+        probss = 0.0;
+        tree = line;
+
+        // "//" is followed by the trees (or an empty line), the prob and segsites lines, unless there is nothing else
+        for (line = endOfLine(line, end) + 1; line < end; line = endOfLine(line, end) + 1) {
+            if (strncmp(line, "prob: ", 6) == 0 || strncmp(line, "segsites: ", 10) == 0) {
+                flags |= BIN_SEGSITES_LINE;
+                treeBytes = line - tree > 1 ? line - tree : 0;
+                break;
+            }
+        }
+        if (line < end && strncmp(line, "prob: ", 6) == 0) {
+            flags |= BIN_PROB_LINE;
+            probss = strtod(line + 6, NULL);
+            line = endOfLine(line, end) + 1;
+        }
+        if (line < end && strncmp(line, "segsites: ", 10) == 0) {
+            segsites = atoi(line + 10);
+            line = endOfLine(line, end) + 1;
+        }
+
+        if (segsites > positionsCapacity) {
+            positionsCapacity = segsites;
+            positions = realloc(positions, sizeof(double) * positionsCapacity);
+        }
+        if (segsites > 0 && line < end && strncmp(line, "positions: ", 11) == 0) {
+            parsed = (char *) line + 11;
+            for (i = 0; i < segsites; i++)
+                positions[i] = strtod(parsed, &parsed);
+            line = endOfLine(line, end) + 1;
+        }
+
+        rowBytes = (segsites + 7) / 8;
+        rows = segsites > 0 ? (int) fields[1] : 0;
+        if (rowBytes * rows > haplotypesCapacity) {
+            haplotypesCapacity = rowBytes * rows;
+            haplotypes = realloc(haplotypes, haplotypesCapacity);
+        }
+        memset(haplotypes, 0, rowBytes * rows);
+        for (i = 0; i < rows && line < end; i++, line = endOfLine(line, end) + 1)
+            for (j = 0; j < segsites && line + j < end; j++)
+                if (line[j] == '1')
+                    haplotypes[i * rowBytes + (j >> 3)] |= 1 << (j & 7);
+
+        recordBytes = BIN_ALIGN(BIN_RECORD_BYTES + sizeof(double) * segsites + sizeof(int) + treeBytes + rowBytes * rows);
+        fwrite(&recordBytes, sizeof(int), 1, out);
+        fwrite(&replicate, sizeof(int), 1, out);
+        fwrite(&segsites, sizeof(int), 1, out);
+        fwrite(&flags, sizeof(int), 1, out);
+        fwrite(&probss, sizeof(double), 1, out);
+        fwrite(positions, sizeof(double), segsites, out);
+        fwrite(&treeBytes, sizeof(int), 1, out);
+        fwrite(tree, sizeof(char), treeBytes, out);
+        writePadded(haplotypes, rowBytes * rows, recordBytes - BIN_RECORD_BYTES - sizeof(double) * segsites - sizeof(int) - treeBytes, out);
+
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 1024;
+            entries = realloc(entries, sizeof(struct binentry) * capacity);
+        }
+        entries[count].replicate = replicate;
+        entries[count++].offset = position;
+        position += recordBytes;
+        replicate++;
+    }
+
+    fwrite(entries, sizeof(struct binentry), count, out);
+    fwrite(&count, sizeof(count), 1, out);
+    fwrite(BIN_INDEX_MAGIC, sizeof(char), 8, out);
+
+    free(entries);
+    free(positions);
+    free(haplotypes);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+    FILE *out = stdout;
+    const char *data;
+    off_t size;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        if ((out = fopen(argv[2], "w")) == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        arg = 3;
+    }
+
+    if (arg != argc - 1) {
+#ifdef TEXT2MS
+        fprintf(stderr, "usage: text2ms [-o output] input\n");
+#else
+        fprintf(stderr, "usage: ms2text [-o output] input\n");
+#endif
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 4 << 20);
+
+    data = mapInput(argv[arg], &size);
+#ifdef TEXT2MS
+    textToBin(data, size, out);
+#else
+    binToText(data, size, out);
+#endif
+
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// **************************************  //
+// MSMERGE
+// **************************************  //
+// Merges the outputs of several runs (shards, jobs with different seeds, per-rank files) into a single ms output:
+// the header of the first input, with howmany set to the total number of replicates, followed by the replicates of
+// every input in order. Inputs are mapped into memory and scanned for replicate boundaries ("\n//", as printed by
+// encodeSample), and the replicates are copied file to file by the kernel. The footer of a run with
+// -walltime is left out, since howmany then counts the replicates actually there.
+//
+// usage: msmerge [-o output] input...
+
+struct input {
+    const char *path;
+    int fd;
+    char *data;
+    off_t size;
+    off_t start;     // first replicate, right after the header
+    off_t end;       // end of the last replicate, before the footer if any
+    long replicates;
+};
+
+/*
+ * Finds the next replicate boundary, i.e. the "\n//" leading every replicate. Slashes appear nowhere else past the
+ * header, so the scan looks for them with memchr, which goes through the data a vector at a time.
+ *
+ * @return offset of the boundary, size when there is none
+ */
+static off_t nextBoundary(const char *data, off_t from, off_t size)
+{
+    const char *slash;
+
+    while (from < size && (slash = memchr(data + from, '/', size - from)) != NULL) {
+        from = slash - data;
+        if (from > 0 && data[from - 1] == '\n' && from + 1 < size && data[from + 1] == '/')
+            return from - 1;
+        from++;
+    }
+
+    return size;
+}
+
+/*
+ * Finds the footer of a run with -walltime, a last line "walltime: <produced> of <howmany> replicates" preceded by
+ * an empty line.
+ *
+ * @return offset of the footer, size when there is none
+ */
+static off_t walltimeFooter(const char *data, off_t start, off_t size)
+{
+    static const char footer[] = "\nwalltime: ";
+    off_t line = size - 1;
+
+    while (line > start && data[line - 1] != '\n')
+        line--;
+    line--; // the empty line before
+
+    if (line >= start && size - line > sizeof(footer) - 1 && memcmp(data + line, footer, sizeof(footer) - 1) == 0)
+        return line;
+
+    return size;
+}
+
+static void openInput(const char *path, struct input *input)
+{
+    struct stat status;
+    off_t boundary;
+
+    input->path = path;
+    input->data = NULL;
+    input->replicates = 0;
+
+    if ((input->fd = open(path, O_RDONLY)) < 0 || fstat(input->fd, &status) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    input->size = input->start = input->end = status.st_size;
+    if (input->size == 0)
+        return;
+
+    input->data = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+    if (input->data == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    madvise(input->data, input->size, MADV_SEQUENTIAL);
+
+    // Outputs without a header (e.g. shards other than 0) start right at their first replicate
+    input->start = nextBoundary(input->data, 0, input->size);
+    input->end = walltimeFooter(input->data, input->start, input->size);
+    for (boundary = input->start; boundary < input->size; boundary = nextBoundary(input->data, boundary + 3, input->size))
+        input->replicates++;
+}
+
+static void writeAll(int out, const char *data, size_t bytes)
+{
+    ssize_t written;
+
+    while (bytes > 0) {
+        if ((written = write(out, data, bytes)) < 0) {
+            perror("write");
+            exit(1);
+        }
+        data += written;
+        bytes -= written;
+    }
+}
+
+/*
+ * Copies the replicates of an input to the output, with copy_file_range when both are regular files on the same
+ * file system, sendfile otherwise and plain writes from the mapping as a last resort.
+ */
+static void copyReplicates(const struct input *input, int out)
+{
+    off_t offset = input->start;
+    ssize_t copied = 0;
+
+    while (offset < input->end && (copied = copy_file_range(input->fd, &offset, out, NULL, input->end - offset, 0)) > 0)
+        ;
+    while (offset < input->end && (copied = sendfile(out, input->fd, &offset, input->end - offset)) > 0)
+        ;
+
+    if (copied < 0 && errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) {
+        perror(input->path);
+        exit(1);
+    }
+    if (offset < input->end)
+        writeAll(out, input->data + offset, input->end - offset);
+}
+
+/*
+ * Writes the header of an input, the third word of its command line (howmany) becoming the given number of
+ * replicates.
+ */
+static void writeHeader(const struct input *input, long replicates, int out)
+{
+    char howmany[32];
+    const char *header = input->data, *end = input->data + input->start;
+    const char *first, *last;
+
+    first = memchr(header, ' ', end - header);
+    if (first != NULL)
+        first = memchr(first + 1, ' ', end - first - 1);
+    last = first != NULL ? memchr(first + 1, ' ', end - first - 1) : NULL;
+
+    if (last == NULL) { // Not an msparsm command line, left as it is
+        writeAll(out, header, end - header);
+        return;
+    }
+
+    snprintf(howmany, sizeof(howmany), "%ld", replicates);
+    writeAll(out, header, first + 1 - header);
+    writeAll(out, howmany, strlen(howmany));
+    writeAll(out, last, end - last);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, arg = 1, out = STDOUT_FILENO, count;
+    long replicates = 0;
+    struct input *inputs;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        if ((out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        arg = 3;
+    }
+
+    if (arg >= argc) {
+        fprintf(stderr, "usage: msmerge [-o output] input...\n");
+        return 1;
+    }
+
+    count = argc - arg;
+    inputs = malloc(sizeof(struct input) * count);
+    for (i = 0; i < count; i++) {
+        openInput(argv[arg + i], &inputs[i]);
+        replicates += inputs[i].replicates;
+    }
+
+    for (i = 0; i < count && inputs[i].start == 0; i++)
+        ;
+    if (i < count)
+        writeHeader(&inputs[i], replicates, out);
+
+    for (i = 0; i < count; i++) {
+        copyReplicates(&inputs[i], out);
+        if (inputs[i].data != NULL)
+            munmap(inputs[i].data, inputs[i].size);
+        close(inputs[i].fd);
+    }
+
+    free(inputs);
+    if (out != STDOUT_FILENO)
+        close(out);
+
+    return 0;
+}
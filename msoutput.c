@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+#include "ms.h"
+#include "msbin.h"
+
+// **************************************  //
+// SAMPLE OUTPUT
+// **************************************  //
+// Text of a sample in the ms format, shared by the MPI (mspar.c) and the threads-only (msthreads.c) builds.
+
+/*
+ * Logic to generate a sample.
+ *
+ * @param index replicate index, which selects the random stream of the sample
+ *
+ * @return the sample generated by the worker
+ */
+char* generateSample(struct params parameters, unsigned maxsites, int index, int *bytes)
+{
+    int segsites, i;
+    double probss, tmrca, ttot;
+    char *results;
+    char **gametes;
+    struct gensam_result gensamResults;
+
+    if (parameters.format == FORMAT_BIN)
+        return generateBinRecord(parameters, maxsites, index, bytes);
+
+    ranstream(parameters.firstreplicate + index);
+
+    if( parameters.mp.segsitesin ==  0 )
+        gametes = cmatrix(parameters.cp.nsam,maxsites+1);
+    else
+        gametes = cmatrix(parameters.cp.nsam, parameters.mp.segsitesin+1 );
+
+    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites);
+
+    results = encodeSample(segsites, probss, parameters, parameters.mp.treeflag ? gensamResults.tree : NULL,
+                           gensamResults.positions, gametes, bytes);
+
+    if (parameters.mp.treeflag)
+        free(gensamResults.tree);
+    free(gensamResults.positions);
+    for (i = 0; i < parameters.cp.nsam; i++)
+        free(gametes[i]);
+    free(gametes);
+
+    return results;
+}
+
+// **************************************  //
+// TEXT ENCODER
+// **************************************  //
+// ms text of a sample, written in a single pass into a buffer of its exact length. Positions are printed from fixed
+// point integers rather than through printf, and gametes are copied row by row.
+
+#define MAX_FIXED_DIGITS 9
+
+static const double powersOfTen[MAX_FIXED_DIGITS + 1] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+/*
+ * Position scaled to the printed digits, rounded exactly as printf would: positions close to a tie are rounded by
+ * printf itself.
+ */
+static long long fixedPoint(double position, int precision)
+{
+    char digits[32], *point;
+    double scaled = position * powersOfTen[precision];
+    double fraction = scaled - floor(scaled);
+
+    if (fabs(fraction - 0.5) > 1e-6)
+        return llround(scaled);
+
+    snprintf(digits, sizeof(digits), "%.*f", precision, position);
+    point = strchr(digits, '.');
+    if (point != NULL)
+        memmove(point, point + 1, strlen(point));
+    return atoll(digits);
+}
+
+static int decimalDigits(int value)
+{
+    int digits = 1;
+
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+/*
+ * Characters printed by "%6.*lf " for a position, which lies between 0 and 1.
+ */
+static int positionWidth(int precision)
+{
+    int width = precision > 0 ? precision + 2 : 1;
+
+    return (width < 6 ? 6 : width) + 1;
+}
+
+/*
+ * Prints a position as "%6.*lf " does, returning the end of the text.
+ */
+static char *putPosition(char *out, double position, int precision)
+{
+    int i, width = positionWidth(precision);
+    long long value;
+
+    if (precision > MAX_FIXED_DIGITS) {
+        snprintf(out, width + 1, "%6.*lf ", precision, position);
+        return out + width;
+    }
+
+    value = fixedPoint(position, precision);
+    out += width;
+    out[-1] = ' ';
+    for (i = 2; i <= precision + 1; i++) {
+        out[-i] = '0' + value % 10;
+        value /= 10;
+    }
+    if (precision > 0)
+        out[-i++] = '.';
+    out[-i++] = '0' + value;
+    for (; i <= width; i++)
+        out[-i] = ' ';
+    return out;
+}
+
+/*
+ * Text of a sample as ms prints it:
+ *    \n
+ *    //trees (with -T)
+ *    prob: x.xxx (with -s and -t)
+ *    segsites: xxx
+ *    positions: 0.xxxxx 0.xxxxx .... etc.
+ *    0010...
+ *
+ * @param tree the trees as printed, or NULL without -T
+ *
+ * @return the text, of *bytes bytes (followed by a null character)
+ */
+char *encodeSample(int segsites, double probss, struct params pars, const char *tree, const double *positions,
+                   char **gametes, int *bytes)
+{
+    int i, value, nsam = pars.cp.nsam, header = segsites > 0 || pars.mp.theta > 0.0;
+    int treeLength = 0, probLength = 0, segsitesLength = decimalDigits(segsites);
+    char prob[32], *results, *out;
+    long length = 3; // "\n//"
+
+    if (header) {
+        treeLength = tree != NULL ? strlen(tree) : 1;
+        if (pars.mp.segsitesin > 0 && pars.mp.theta > 0.0)
+            probLength = snprintf(prob, sizeof(prob), "prob: %g\n", probss);
+        length += treeLength + probLength + 10 + segsitesLength + 1; // "segsites: " + digits + LF
+    }
+    if (segsites > 0)
+        length += 11 + (long) positionWidth(pars.output_precision) * segsites + 1 // "positions: " + sites + LF
+                  + (long) (segsites + 1) * nsam + 1;                           // rows + trailing " "
+
+    results = malloc(length + 1);
+    out = results;
+
+    memcpy(out, "\n//", 3);
+    out += 3;
+    if (header) {
+        if (tree != NULL)
+            memcpy(out, tree, treeLength);
+        else
+            *out = '\n';
+        out += treeLength;
+        memcpy(out, prob, probLength);
+        out += probLength;
+        memcpy(out, "segsites: ", 10);
+        out += 10;
+        for (i = segsitesLength - 1, value = segsites; i >= 0; i--, value /= 10)
+            out[i] = '0' + value % 10;
+        out += segsitesLength;
+        *out++ = '\n';
+    }
+
+    if (segsites > 0) {
+        memcpy(out, "positions: ", 11);
+        out += 11;
+        for (i = 0; i < segsites; i++)
+            out = putPosition(out, positions[i], pars.output_precision);
+        *out++ = '\n';
+
+        for (i = 0; i < nsam; i++) {
+            memcpy(out, gametes[i], segsites);
+            out += segsites;
+            *out++ = '\n';
+        }
+        *out++ = ' ';
+    }
+    *out = '\0';
+
+    *bytes = length;
+    return results;
+}
+
+// **************************************  //
+// BINARY RECORDS
+// **************************************  //
+// Compact form of a sample sent between ranks (MSPARSM_WIRE=binary), turned into ms text by the writer only:
+//     int      size of the record in bytes
+//     int      segsites
+//     double   probss
+//     int      length of the trees, followed by the trees as printed (with -T)
+//     varints  zigzag encoded differences between consecutive positions in fixed point, with as many decimal digits
+//              as printed (up to MAX_FIXED_DIGITS, doubles beyond that)
+//     bytes    haplotypes packed site by site, nsam bits per site
+// Processes are expected to share the same byte order.
+
+static char *putVarint(char *out, unsigned long long value)
+{
+    while (value >= 0x80) {
+        *out++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char) value;
+    return out;
+}
+
+static const char *getVarint(const char *in, unsigned long long *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    do {
+        *value |= (unsigned long long) (*in & 0x7F) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+    return in;
+}
+
+/*
+ * Generates a sample as a binary record (see above) instead of text.
+ *
+ * @param index replicate index, which selects the random stream of the sample
+ *
+ * @return the record, of *bytes bytes
+ */
+char *generateRecord(struct params parameters, unsigned maxsites, int index, int *bytes)
+{
+    int segsites, i, j, treeBytes, nsam = parameters.cp.nsam;
+    int precision = parameters.output_precision;
+    double probss = 0.0, tmrca, ttot;
+    long long previous = 0, current;
+    char **gametes, *record, *out;
+    unsigned char *haplotypes;
+    struct gensam_result gensamResults;
+
+    ranstream(parameters.firstreplicate + index);
+
+    if( parameters.mp.segsitesin ==  0 )
+        gametes = cmatrix(nsam, maxsites+1);
+    else
+        gametes = cmatrix(nsam, parameters.mp.segsitesin+1 );
+
+    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites);
+    treeBytes = parameters.mp.treeflag ? gensamResults.treeBytes : 0;
+
+    // Worst case: 10 bytes per varint or 8 per double
+    record = malloc(3 * sizeof(int) + sizeof(double) + treeBytes + 10 * segsites + ((long) nsam * segsites + 7) / 8);
+    out = record + sizeof(int);
+    memcpy(out, &segsites, sizeof(int));
+    out += sizeof(int);
+    memcpy(out, &probss, sizeof(double));
+    out += sizeof(double);
+    memcpy(out, &treeBytes, sizeof(int));
+    out += sizeof(int);
+    if (treeBytes > 0) {
+        memcpy(out, gensamResults.tree, treeBytes);
+        out += treeBytes;
+        free(gensamResults.tree);
+    }
+
+    for (i = 0; i < segsites; i++) {
+        if (precision > MAX_FIXED_DIGITS) {
+            memcpy(out, &gensamResults.positions[i], sizeof(double));
+            out += sizeof(double);
+            continue;
+        }
+        current = fixedPoint(gensamResults.positions[i], precision);
+        out = putVarint(out, ((unsigned long long) (current - previous) << 1) ^ (unsigned long long) ((current - previous) >> 63));
+        previous = current;
+    }
+
+    haplotypes = (unsigned char *) out;
+    memset(haplotypes, 0, ((long) nsam * segsites + 7) / 8);
+    for (j = 0; j < segsites; j++)
+        for (i = 0; i < nsam; i++)
+            if (gametes[i][j] == '1')
+                haplotypes[((long) j * nsam + i) >> 3] |= 1 << (((long) j * nsam + i) & 7);
+    out += ((long) nsam * segsites + 7) / 8;
+
+    *bytes = out - record;
+    memcpy(record, bytes, sizeof(int));
+
+    free(gensamResults.positions);
+    for (i = 0; i < nsam; i++)
+        free(gametes[i]);
+    free(gametes);
+
+    return record;
+}
+
+/*
+ * Turns a binary record into the text generateSample would have produced for the same sample.
+ *
+ * @param record the record, whose size is given by its first int
+ *
+ * @return the text of the sample, of *bytes bytes
+ */
+char *formatRecord(const char *record, struct params parameters, int *bytes)
+{
+    int segsites, i, j, treeBytes, nsam = parameters.cp.nsam;
+    int precision = parameters.output_precision;
+    double probss, *positions;
+    long long previous = 0;
+    unsigned long long zigzag;
+    const char *in = record + sizeof(int);
+    const unsigned char *haplotypes;
+    char *tree = NULL, **gametes, *results;
+
+    memcpy(&segsites, in, sizeof(int));
+    in += sizeof(int);
+    memcpy(&probss, in, sizeof(double));
+    in += sizeof(double);
+    memcpy(&treeBytes, in, sizeof(int));
+    in += sizeof(int);
+    if (parameters.mp.treeflag) {
+        tree = malloc(treeBytes + 1);
+        memcpy(tree, in, treeBytes);
+        tree[treeBytes] = '\0';
+        in += treeBytes;
+    }
+
+    positions = malloc(sizeof(double) * segsites);
+    for (i = 0; i < segsites; i++) {
+        if (precision > MAX_FIXED_DIGITS) {
+            memcpy(&positions[i], in, sizeof(double));
+            in += sizeof(double);
+            continue;
+        }
+        in = getVarint(in, &zigzag);
+        previous += (long long) (zigzag >> 1) ^ -(long long) (zigzag & 1);
+        positions[i] = previous / powersOfTen[precision];
+    }
+
+    haplotypes = (const unsigned char *) in;
+    gametes = cmatrix(nsam, segsites + 1);
+    for (i = 0; i < nsam; i++)
+        for (j = 0; j < segsites; j++)
+            gametes[i][j] = haplotypes[((long) j * nsam + i) >> 3] & (1 << (((long) j * nsam + i) & 7)) ? '1' : '0';
+
+    results = encodeSample(segsites, probss, parameters, tree, positions, gametes, bytes);
+
+    free(tree);
+    free(positions);
+    for (i = 0; i < nsam; i++)
+        free(gametes[i]);
+    free(gametes);
+
+    return results;
+}
+
+// **************************************  //
+// BINARY CONTAINER
+// **************************************  //
+// Output with -format bin, laid out as described in msbin.h.
+
+/*
+ * Generates a sample as a record of the binary container.
+ *
+ * @param index replicate index, which selects the random stream of the sample
+ *
+ * @return the record, of *bytes bytes
+ */
+char *generateBinRecord(struct params parameters, unsigned maxsites, int index, int *bytes)
+{
+    int segsites, i, j, nsam = parameters.cp.nsam;
+    unsigned int replicate = parameters.firstreplicate + index, flags = 0, treeBytes = 0;
+    long rowBytes, columnBytes, haplotypeBytes;
+    double probss = 0.0, tmrca, ttot;
+    char **gametes, *record, *out;
+    unsigned char *row;
+    struct gensam_result gensamResults;
+
+    ranstream(parameters.firstreplicate + index);
+
+    if( parameters.mp.segsitesin ==  0 )
+        gametes = cmatrix(nsam, maxsites+1);
+    else
+        gametes = cmatrix(nsam, parameters.mp.segsitesin+1 );
+
+    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites);
+
+    // Same conditions as encodeSample
+    if (segsites > 0 || parameters.mp.theta > 0.0)
+        flags |= BIN_SEGSITES_LINE;
+    if (parameters.mp.segsitesin > 0 && parameters.mp.theta > 0.0)
+        flags |= BIN_PROB_LINE;
+    if ((flags & BIN_SEGSITES_LINE) && parameters.mp.treeflag)
+        treeBytes = gensamResults.treeBytes;
+    if (treeBytes > 0 && parameters.mp.treeflag == TREES_BIN)
+        flags |= BIN_BINARY_TREES;
+    if ((flags & BIN_BINARY_TREES) && (parameters.cp.r > 0.0 || parameters.cp.f > 0.0))
+        flags |= BIN_TREE_SITES;
+
+    if (parameters.sitemajor)
+        flags |= BIN_SITE_MAJOR;
+
+    rowBytes = (segsites + 7) / 8;
+    columnBytes = (nsam + 7) / 8;
+    haplotypeBytes = flags & BIN_SITE_MAJOR ? columnBytes * segsites : rowBytes * nsam;
+    *bytes = BIN_ALIGN(BIN_RECORD_BYTES + sizeof(double) * segsites + sizeof(int) + treeBytes + haplotypeBytes);
+    record = calloc(*bytes, sizeof(char));
+
+    memcpy(record, bytes, sizeof(int));
+    memcpy(record + 4, &replicate, sizeof(int));
+    memcpy(record + 8, &segsites, sizeof(int));
+    memcpy(record + 12, &flags, sizeof(int));
+    memcpy(record + 16, &probss, sizeof(double));
+    out = record + BIN_RECORD_BYTES;
+    memcpy(out, gensamResults.positions, sizeof(double) * segsites);
+    out += sizeof(double) * segsites;
+    memcpy(out, &treeBytes, sizeof(int));
+    out += sizeof(int);
+    if (treeBytes > 0) { // The trees are only there with -T
+        memcpy(out, gensamResults.tree, treeBytes);
+        out += treeBytes;
+    }
+
+    if (flags & BIN_SITE_MAJOR) {
+        for (i = 0; i < nsam; i++)
+            for (j = 0; j < segsites; j++)
+                if (gametes[i][j] == '1')
+                    ((unsigned char *) out)[j * columnBytes + (i >> 3)] |= 1 << (i & 7);
+    } else {
+        for (i = 0; i < nsam; i++) {
+            row = (unsigned char *) out + i * rowBytes;
+            for (j = 0; j < segsites; j++)
+                if (gametes[i][j] == '1')
+                    row[j >> 3] |= 1 << (j & 7);
+        }
+    }
+
+    if (parameters.mp.treeflag)
+        free(gensamResults.tree);
+    free(gensamResults.positions);
+    for (i = 0; i < nsam; i++)
+        free(gametes[i]);
+    free(gametes);
+
+    return record;
+}
+
+/*
+ * Header of the binary container, holding the text header of the run (command line and seeds).
+ */
+char *binHeader(const char *text, struct params parameters, long *bytes)
+{
+    unsigned int fields[4] = { BIN_VERSION, parameters.cp.nsam, parameters.output_precision, strlen(text) };
+    char *header;
+
+    *bytes = BIN_ALIGN(BIN_HEADER_BYTES + fields[3]);
+    header = calloc(*bytes, sizeof(char));
+    memcpy(header, BIN_MAGIC, 8);
+    memcpy(header + 8, fields, sizeof(fields));
+    memcpy(header + BIN_HEADER_BYTES, text, fields[3]);
+
+    return header;
+}
+
+/*
+ * Adds the records of a block of consecutive records to the index.
+ *
+ * @param offset where the block is in the file
+ */
+void addBinRecords(struct binindex *index, const char *records, long bytes, unsigned long long offset)
+{
+    long position;
+    unsigned int size, replicate;
+
+    for (position = 0; position < bytes; position += size) {
+        memcpy(&size, records + position, sizeof(int));
+        memcpy(&replicate, records + position + 4, sizeof(int));
+        if (index->count == index->capacity) {
+            index->capacity = index->capacity > 0 ? 2 * index->capacity : 1024;
+            index->entries = realloc(index->entries, sizeof(struct binentry) * index->capacity);
+        }
+        index->entries[index->count].replicate = replicate;
+        index->entries[index->count++].offset = offset + position;
+    }
+}
+
+static int compareBinEntries(const void *a, const void *b)
+{
+    unsigned long long x = ((const struct binentry *) a)->replicate, y = ((const struct binentry *) b)->replicate;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Index closing the binary container, sorted by replicate index. The entries of the index are released.
+ */
+char *binIndexFooter(struct binindex *index, long *bytes)
+{
+    unsigned long long count = index->count;
+    char *footer;
+
+    if (count > 1)
+        qsort(index->entries, count, sizeof(struct binentry), compareBinEntries);
+
+    *bytes = sizeof(struct binentry) * count + BIN_TRAILER_BYTES;
+    footer = malloc(*bytes);
+    if (count > 0)
+        memcpy(footer, index->entries, sizeof(struct binentry) * count);
+    memcpy(footer + sizeof(struct binentry) * count, &count, sizeof(count));
+    memcpy(footer + *bytes - 8, BIN_INDEX_MAGIC, 8);
+
+    free(index->entries);
+    index->entries = NULL;
+    index->count = index->capacity = 0;
+
+    return footer;
+}
+
+// **************************************  //
+// COMPRESSED OUTPUT
+// **************************************  //
+// Output with -gz, as BGZF blocks: gzip members of at most 64 KB whose extra field holds their size, as written by
+// bgzip and read by gzip, zcat and htslib. Blocks are compressed independently, so whatever compresses some output
+// (a worker, a thread) hands over blocks which are just laid one after the other, and an empty block ends the file.
+
+#define GZ_BLOCK 0xff00       // uncompressed bytes in a block, so that even incompressible data fits in 64 KB
+#define GZ_MAX_BLOCK 0x10000  // bytes in a block, at most
+#define GZ_HEADER_BYTES 18    // gzip header with the BC extra field holding the size of the block
+#define GZ_FOOTER_BYTES 8     // CRC32 and uncompressed size
+
+static const unsigned char gzHeader[GZ_HEADER_BYTES] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+static const unsigned char gzEnd[] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void putLittleEndian(unsigned char *out, unsigned long value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++, value >>= 8)
+        out[i] = value & 0xff;
+}
+
+/*
+ * Compresses some output into BGZF blocks, every GZ_BLOCK bytes of it in a block of its own.
+ *
+ * @param level zlib compression level, 1 to 9
+ *
+ * @return the blocks, of *compressed bytes
+ */
+char *compressOutput(const char *data, long bytes, int level, long *compressed)
+{
+    long offset, length;
+    unsigned char *blocks, *block;
+    z_stream stream = { 0 };
+
+    blocks = malloc((bytes + GZ_BLOCK - 1) / GZ_BLOCK * GZ_MAX_BLOCK + 1);
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Unable to compress the output: %s\n", stream.msg ? stream.msg : "zlib initialization failed");
+        exit(1);
+    }
+
+    for (*compressed = offset = 0; offset < bytes; offset += length) {
+        length = bytes - offset < GZ_BLOCK ? bytes - offset : GZ_BLOCK;
+        block = blocks + *compressed;
+
+        deflateReset(&stream);
+        stream.next_in = (unsigned char *) data + offset;
+        stream.avail_in = length;
+        stream.next_out = block + GZ_HEADER_BYTES;
+        stream.avail_out = GZ_MAX_BLOCK - GZ_HEADER_BYTES - GZ_FOOTER_BYTES;
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "Unable to compress the output: block larger than %d bytes\n", GZ_MAX_BLOCK);
+            exit(1);
+        }
+
+        memcpy(block, gzHeader, GZ_HEADER_BYTES);
+        putLittleEndian(block + 16, GZ_HEADER_BYTES + stream.total_out + GZ_FOOTER_BYTES - 1, 2);
+        block += GZ_HEADER_BYTES + stream.total_out;
+        putLittleEndian(block, crc32(0, (const unsigned char *) data + offset, length), 4);
+        putLittleEndian(block + 4, length, 4);
+        *compressed += GZ_HEADER_BYTES + stream.total_out + GZ_FOOTER_BYTES;
+    }
+
+    deflateEnd(&stream);
+    return realloc(blocks, *compressed + 1);
+}
+
+/*
+ * Empty block ending BGZF output.
+ */
+char *compressedEnd(long *bytes)
+{
+    char *end = malloc(sizeof(gzEnd));
+
+    memcpy(end, gzEnd, sizeof(gzEnd));
+    *bytes = sizeof(gzEnd);
+    return end;
+}
@@ -1,12 +1,84 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "ms.h"
+#include "msbin.h"
 #include "mspar.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 const int RESULTS_TAG = 300;
+const int WORK_REQUEST_TAG = 301;
+const int WORK_TAG = 302;
+const int LAST_RESULTS_TAG = 303;
+const int ACK_TAG = 304;
+const int SLAB_TAG = 305;
+const int LAST_SLAB_TAG = 306;
+const int SLAB_ACK_TAG = 307;
+const int LARGE_RESULTS_TAG = 308; // results larger than a batch, which do not fit in the receives posted by rank 0
+
+#define RECEIVE_BUFFERS 4 // receives of batches rank 0 keeps posted
+#define IDLE_POLLS 100 // polls of rank 0 finding nothing before it sleeps between them
+#define IDLE_MAX_SLEEP 256 // longest sleep of rank 0 between polls, in microseconds
+#define MAX_MESSAGE (1L << 30) // bytes in a single message or MPI-IO call, well within the int counts of MPI
+#define WRITER_QUEUE 64 // buffers waiting for the writer thread, at most
+#define WRITE_BLOCK (4L << 20) // smaller buffers are gathered by the writer thread into writes of this size
 
 int diagnose = 0; // Used for diagnosing the application.
+int dynamic = 1;  // Replicates are handed out on demand. MSPARSM_SCHEDULE=static restores the even split.
+int minChunk = 1; // Smallest chunk of replicates handed out by the scheduler (MSPARSM_MIN_CHUNK).
+long batchSize = 4 << 20; // Workers flush their results once a batch reaches this size (MSPARSM_BATCH_SIZE, 0 = unbounded).
+char *outputFile = NULL;  // Shared file written through MPI-IO (-o), stdout otherwise.
+int pilot = 0;            // Replicates timed by every process to weigh its share of the work (MSPARSM_PILOT, 0 = none).
+double masterWeight = 0.5; // Share of its throughput the master devotes to samples, besides writing (MSPARSM_MASTER_WEIGHT).
+double *weights = NULL;   // Throughput of every process, as measured by the pilot.
+int serving = 0;          // Runs are requested through a socket (-server).
+double walltime = 0;      // Seconds after which no more replicates are handed out (-walltime, 0 = unbounded).
+double runStart;          // MPI_Wtime at the start of the run.
+int fanIn = 16;           // Node masters sending their results to the same node master, at most (MSPARSM_FAN_IN).
+int checkpointInterval = 0; // Replicates written to the output file between checkpoints (MSPARSM_CHECKPOINT, 0 = none).
+char *header = NULL;      // Command line and seeds, leading the output of the global master.
+long headerBytes = 0;     // Size of the header, which is binary with -format bin.
+int format = FORMAT_TEXT; // Output format (-format).
+int gz = 0;               // Compression level of the output (-gz), 0 = uncompressed.
+struct binindex binIndex; // -format bin: offsets of the records written by this process.
+unsigned long long outputOffset = 0; // -format bin: bytes written to stdout by rank 0.
+int threads = 1;          // Threads generating samples in every process (MSPARSM_THREADS).
+struct ranstate processStream; // RNG seeded from the command line, the starting point of every thread.
+int segmentThreads = 1;   // Threads placing mutations within every sample (MSPARSM_SEGMENT_THREADS).
+int binaryWire = 0;       // Workers stream binary records, formatted by the writer (MSPARSM_WIRE=binary).
+struct params recordParameters; // Parameters of the run, needed to format binary records.
+int ordered = 0;          // Samples are written in replicate order (MSPARSM_ORDER=index).
+int orderWindow = 1024;   // Replicates handed out ahead of the next one to be written (MSPARSM_ORDER_WINDOW).
+int nextToWrite = 0;      // Ordered output: index of the next replicate to be written.
+char **reorder;           // Ordered output: samples waiting for their turn, by index modulo orderWindow.
+int *reorderLengths;
+int writerThread = 0;     // Rank 0 writes to stdout from a thread of its own (MSPARSM_WRITER=thread).
+int masterMaxNodes = 0;   // Static mode: rank 0 generates no samples on more nodes than this (MSPARSM_MASTER_MAX_NODES, 0 = any).
+
+// Writer thread: rank 0 queues its output, buffers it hands over, and the writer writes and frees them in order.
+// A single producer and a single consumer, which wait on queueChanged while the queue is full or empty respectively.
+struct output {
+    char *data;
+    long bytes;
+};
+struct output writerQueue[WRITER_QUEUE];
+unsigned long queueHead = 0; // next buffer to be written, only moved by the writer
+unsigned long queueTail = 0; // next free slot, only moved by rank 0
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER; // guards the head and tail of the queue
+pthread_cond_t queueChanged = PTHREAD_COND_INITIALIZER; // a buffer was queued, or taken by the writer
+pthread_t writer;
+int writerRunning = 0;
 
 // Following variables are with global scope in order to facilitate its sharing among routines.
 // They are going to be updated in the masterWorkerSetup routine only, which is called only one, therefore there is no
@@ -14,93 +86,164 @@ int diagnose = 0; // Used for diagnosing the application.
 MPI_Comm shmcomm; // shm intra-communicator
 int world_rank, shm_rank;
 int world_size, shm_size;
+int node_master; // rank in MPI_COMM_WORLD of the process with shm_rank = 0 in the same node
+MPI_Comm nodecomm = MPI_COMM_NULL; // node masters, in MPI_COMM_WORLD rank order (static mode)
+int node_rank;   // rank in nodecomm, i.e. position of the node in the aggregation tree
+MPI_Win slabs;   // two slabs per worker of the node where batches are written in place (dynamic mode)
 
 // **************************************  //
 // MASTER
 // **************************************  //
-void singleNodeProcessing(int howmany, struct params parameters, unsigned int maxsites, int *bytes)
+void singleNodeProcessing(int samples, int first, struct params parameters, unsigned int maxsites, long *bytes)
 {
     // No master process is needed. Every MPI process can just output the generated samples
-    int samples = howmany / world_size;
-    int remainder = howmany % world_size;
-
-    if (world_rank == 0) // let the "global master" to generate the remainder samples as well
-        samples += remainder;
-
     if (diagnose)
         fprintf(stderr, "[%d] -> Vamos a generar [%d] samples.\n", world_rank, samples);
 
-    char *results = generateSamples(samples, parameters, maxsites, bytes);
+    char *results = generateSamples(first, samples, parameters, maxsites, bytes);
     printSamples(results, *bytes);
 }
 
-void printSamples(char *results, int bytes)
+void printSamples(char *results, long bytes)
 {
-    fprintf(stdout, "%s", results);
-    fflush(stdout);
-
     if (diagnose)
-        fprintf(stderr, "[%d] -> Printed [%d] bytes.\n", world_rank, bytes);
+        fprintf(stderr, "[%d] -> Printed [%ld] bytes.\n", world_rank, bytes);
+
+    if (writerRunning) { // The writer frees them
+        queueOutput(results, bytes);
+        return;
+    }
+
+    fwrite(results, sizeof(char), bytes, stdout);
+    fflush(stdout);
 
     free(results); // be good citizen
 }
 
-void secondaryNodeProcessing(int remaining, struct params parameters, unsigned int maxsites)
+void secondaryNodeProcessing(int first, int remaining, int nodes, struct params parameters, unsigned int maxsites)
 {
-    int bytes = 0;
-    char *results = malloc(sizeof(char) * 1000);
+    long bytes = 0;
+    int source, child, last = lastChild(node_rank, nodes);
+    char *results = NULL, *child_results;
     if (remaining > 0)
-        results = generateSamples(remaining, parameters, maxsites, &bytes);
+        results = generateSamples(first, remaining, parameters, maxsites, &bytes);
+
+    // Samples of every process in the node end up one after the other in a shared window
+    MPI_Win win;
+    char *node_results;
+    MPI_Aint node_bytes;
+    node_results = shareNodeResults(results, bytes, &win, &node_bytes);
+
+    // Aggregators append the results of their subtree to those of their node
+    results = node_results;
+    if (last >= firstChild(node_rank)) {
+        results = malloc(node_bytes);
+        memcpy(results, node_results, node_bytes);
+    }
+    // Children answer in any order, so the source of each message must not be written over the loop counter
+    for (child = firstChild(node_rank); child <= last; child++) {
+        child_results = readResults(nodecomm, &source, &bytes);
+        results = realloc(results, node_bytes + bytes);
+        memcpy(results + node_bytes, child_results, bytes);
+        node_bytes += bytes;
+        free(child_results);
+    }
 
-    // Receive samples from workers in same node.
-    int i;
-    char *shm_results;
-    for (i = 1; i < shm_size; i++){
-        int source, length;
+    // Send gathered results to the parent node master, straight from the shared window if there is nothing to add
+    sendResults(results, node_bytes, (node_rank - 1) / fanIn, nodecomm);
 
-        shm_results = readResults(shmcomm, &source, &length);
-        results = realloc(results, bytes + length + 1);
-        memcpy(results + bytes, shm_results, length);
-        bytes += length + 1;
-        free(shm_results);
-    }
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Sent [%ld] bytes to node %d.\n", world_rank, (long) node_bytes, (node_rank - 1) / fanIn);
 
-    // Send gathered results to master in master-node
-    sendResultsToMaster(results, bytes, MPI_COMM_WORLD);
+    if (results != node_results)
+        free(results);
+    MPI_Win_free(&win);
 }
 
-void sendResultsToMaster(char *results, int bytes, MPI_Comm comm)
+/*
+ * Copies the results of a process into its segment of a window shared by the whole node (collective over shmcomm).
+ * Segments are allocated contiguously in shm rank order, so the node master finds the output of the node as a
+ * single block starting at its own segment, with no further copy nor message per worker.
+ *
+ * @param win the shared window, to be freed by the caller once the node results are no longer needed
+ * @param node_bytes size of the results of the whole node
+ *
+ * @return start of the results of the whole node
+ */
+char *shareNodeResults(char *results, long bytes, MPI_Win *win, MPI_Aint *node_bytes)
 {
-    MPI_Send(results, bytes + 1, MPI_CHAR, 0, RESULTS_TAG, comm);
+    char *segment, *node_results;
+    int disp_unit;
+    MPI_Aint size;
+    long total;
 
-    if (diagnose) {
-        char *communicator = "MPI_COMM_WORLD";
-        if (comm != MPI_COMM_WORLD)
-            communicator = "SHM_COMM";
+    MPI_Win_allocate_shared(bytes, sizeof(char), MPI_INFO_NULL, shmcomm, &segment, win);
+    memcpy(segment, results, bytes);
+    free(results);
 
-        fprintf(stderr, "[%d] -> Sent [%d] bytes to master in %s.\n", world_rank, bytes + 1, communicator);
-    }
+    MPI_Allreduce(&bytes, &total, 1, MPI_LONG, MPI_SUM, shmcomm); // also ensures every segment has been filled
+    MPI_Win_shared_query(*win, 0, &size, &disp_unit, &node_results);
 
-    free(results);
+    *node_bytes = total;
+    return node_results;
 }
 
-void principalMasterProcessing(int remaining, int nodes, struct params parameters, unsigned int maxsites)
+void principalMasterProcessing(int first, int remaining, int nodes, struct params parameters, unsigned int maxsites)
 {
-    int bytes = 0;
+    long bytes = 0;
     if (remaining > 0) {
-        char *results = generateSamples(remaining, parameters, maxsites, &bytes);
+        char *results = generateSamples(first, remaining, parameters, maxsites, &bytes);
         printSamples(results, bytes);
     }
 
-    // Receive samples from other node masters, each one sending a consolidated message
+    // Receive samples from the node masters below in the aggregation tree, each one sending a consolidated message
+    // with the results of its whole subtree
     int source, i;
     char *shm_results;
-    for (i = 1; i < nodes; i++){
-        shm_results = readResults(MPI_COMM_WORLD, &source, &bytes);
+    for (i = firstChild(0); i <= lastChild(0, nodes); i++){
+        shm_results = readResults(nodecomm, &source, &bytes);
         printSamples(shm_results, bytes);
     }
 }
 
+/*
+ * Arranges the node masters in a k-ary tree, so that no process receives results from more than fanIn nodes: the
+ * node of rank i in nodecomm (the global master being node 0) sends its results to node (i - 1) / fanIn.
+ *
+ * @return depth of the tree, i.e. the longest chain of messages from a node to the global master
+ */
+int buildAggregationTree(int nodes)
+{
+    int depth = 0, i;
+
+    MPI_Comm_split(MPI_COMM_WORLD, shm_rank == 0 ? 0 : MPI_UNDEFINED, world_rank, &nodecomm);
+    if (nodecomm != MPI_COMM_NULL)
+        MPI_Comm_rank(nodecomm, &node_rank);
+
+    for (i = nodes - 1; i > 0; i = (i - 1) / fanIn)
+        depth++;
+
+    if (diagnose && world_rank == 0)
+        fprintf(stderr, "[%d] -> Aggregation tree of %d nodes, fan-in %d, depth %d\n", world_rank, nodes, fanIn, depth);
+
+    return depth;
+}
+
+int firstChild(int node)
+{
+    return node * fanIn + 1;
+}
+
+/*
+ * @return last child of the node in the aggregation tree, less than firstChild(node) for a leaf
+ */
+int lastChild(int node, int nodes)
+{
+    int last = node * fanIn + fanIn;
+
+    return last < nodes ? last : nodes - 1;
+}
+
 int calculateNumberOfNodes()
 {
     // Gather all SHM rank (local rank) from all the processes
@@ -119,369 +262,1919 @@ int calculateNumberOfNodes()
     return nodes;
 }
 
-int setup(int argc, char *argv[], int howmany, struct params parameters)
+// **************************************  //
+// DYNAMIC SCHEDULING
+// **************************************  //
+
+/*
+ * Hands out chunks of replicate indices to the workers as they ask for them (guided self-scheduling).
+ * The chunk size is proportional to the remaining work, so chunks shrink toward the end of the run
+ * and a slow replicate delays only its own chunk instead of a whole static share.
+ *
+ * Rank 0 only schedules and writes: it does not generate samples while there are workers asking for work.
+ * Workers stream their results in batches, which are written out as soon as they arrive and released
+ * afterwards. A worker does not send a third batch until one of the previous two is released, so the master
+ * never holds more than a couple of batches per worker.
+ *
+ * Receives of batches are posted in advance, so that batches keep landing while the master writes out the previous
+ * ones; anything else (work requests, slabs, last and larger results) is probed for. When polling finds nothing for a
+ * while, the master sleeps between polls (see backOff).
+ *
+ * With ordered output, no replicate is handed out beyond the reorder window (see reorderResults): workers asking
+ * for work while the window is full are told to retry.
+ *
+ * With a walltime, chunks are also bounded by what the requesting process is expected to complete in the time left
+ * (see budgetChunk), and nothing is handed out once it is over: the run ends with the replicates handed out so far.
+ *
+ * @param first index of the first replicate to hand out
+ * @param howmany number of replicates to hand out
+ * @param workers number of threads generating samples
+ * @param sources number of processes sending results to rank 0 (ignored when writing to a file)
+ *
+ * @return number of replicates handed out, all of them completed
+ */
+int scheduleReplicates(int first, int howmany, int workers, int sources)
 {
-    // seedMatrix       : matrix containing the RNG seeds to be distributed to working processes.
-    // localSeedMatrix  : matrix used by workers to receive RNG seeds from master.
-    unsigned short *seedMatrix;
-    unsigned short localSeedMatrix[3];
+    int next = first;
+    int chunk[2];
+    int bytes, capacity = 0;
+    char *results, *buffer = NULL;
+    MPI_Status status;
+    int i, index, flag, cancelled, idle = 0;
+    int posted = outputFile == NULL && batchSize > 0 ? RECEIVE_BUFFERS : 0;
+    char *received[RECEIVE_BUFFERS];
+    MPI_Request requests[RECEIVE_BUFFERS];
+    int *assigned = calloc(world_size, sizeof(int));  // replicates of the last chunk of every process
+    int *completed = calloc(world_size, sizeof(int)); // replicates of the previous chunks of every process
+    double *started = calloc(world_size, sizeof(double)); // when every process got its first chunk
+
+    if (outputFile != NULL) // Results are not streamed, the run is over once every worker ran out of work
+        sources = workers;
+
+    if (ordered) {
+        nextToWrite = first;
+        reorder = calloc(orderWindow, sizeof(char *));
+        reorderLengths = calloc(orderWindow, sizeof(int));
+    }
 
-    if (getenv("MSPARSM_DIAGNOSE")) diagnose = 1;
+    for (i = 0; i < posted; i++) {
+        received[i] = malloc(batchSize);
+        MPI_Irecv(received[i], batchSize, MPI_CHAR, MPI_ANY_SOURCE, RESULTS_TAG, MPI_COMM_WORLD, &requests[i]);
+    }
 
-    // MPI Initialization
-    MPI_Init(&argc, &argv );
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    while (sources > 0) {
+        // Write stage: a batch that landed in a posted receive is written out, and the receive posted again
+        if (posted > 0) {
+            MPI_Testany(posted, requests, &index, &flag, &status);
+            if (flag && index != MPI_UNDEFINED) {
+                writeReceived(received, requests, index, &status);
+                idle = 0;
+                continue;
+            }
+        }
 
-    // MPI_COMM_TYPE_SHARED: This type splits the communicator into subcommunicators, each of which can create a shared memory region.
-    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shmcomm);
-    MPI_Comm_size(shmcomm, &shm_size);
-    MPI_Comm_rank(shmcomm, &shm_rank);
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (!flag) {
+            backOff(&idle);
+            continue;
+        }
+        idle = 0;
+
+        if (status.MPI_TAG == WORK_REQUEST_TAG) {
+            MPI_Recv(NULL, 0, MPI_INT, status.MPI_SOURCE, WORK_REQUEST_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            // A process asks for work once it has taken every replicate of its last chunk
+            completed[status.MPI_SOURCE] += assigned[status.MPI_SOURCE];
+            assigned[status.MPI_SOURCE] = 0;
+            if (started[status.MPI_SOURCE] == 0)
+                started[status.MPI_SOURCE] = MPI_Wtime();
+
+            chunk[0] = next;
+            chunk[1] = chunkSize(first + howmany - next, workers, status.MPI_SOURCE);
+            if (walltime > 0)
+                chunk[1] = budgetChunk(chunk[1], completed[status.MPI_SOURCE], started[status.MPI_SOURCE]);
+            if (ordered && chunk[1] > nextToWrite + orderWindow - next) // -1: retry once the window moves on
+                chunk[1] = nextToWrite + orderWindow - next > 0 ? nextToWrite + orderWindow - next : -1;
+            if (chunk[1] > 0) {
+                next += chunk[1];
+                assigned[status.MPI_SOURCE] = chunk[1];
+            }
 
-    if (world_rank == 0) { // print out program parameters
-        int i;
-        for(i=0; i<argc; i++)
-            fprintf(stdout, "%s ",argv[i]);
-        fflush(stdout);
-    }
+            MPI_Send(chunk, 2, MPI_INT, status.MPI_SOURCE, WORK_TAG, MPI_COMM_WORLD);
 
-    initializeSeedMatrix(argc, argv, howmany);
+            if (chunk[1] == 0 && outputFile != NULL)
+                sources--;
 
-    int nodes = calculateNumberOfNodes();
+            if (diagnose)
+                fprintf(stderr, "[%d] -> Assigned replicates [%d, %d) to worker %d.\n", world_rank, chunk[0], chunk[0] + chunk[1], status.MPI_SOURCE);
+        } else {
+            results = receiveResults(&status, &bytes, &buffer, &capacity);
+            writeResults(results, bytes);
 
-    if (diagnose)
-        fprintf(stderr, "[%d] -> SHM Rank=%d, SHM Size=%d, WORLD Size=%d\n", world_rank, shm_rank, shm_size, world_size);
+            if (releaseResults(&status))
+                sources--;
+        }
+    }
 
-    if(diagnose && world_rank == 0)
-        fprintf(stderr, "[%d] -> # of nodes=%d\n", world_rank, nodes);
+    // A batch may have been matched before the last results of its worker were probed
+    for (i = 0; i < posted; i++) {
+        MPI_Cancel(&requests[i]);
+        MPI_Wait(&requests[i], &status);
+        MPI_Test_cancelled(&status, &cancelled);
+        if (!cancelled) {
+            MPI_Get_count(&status, MPI_CHAR, &bytes);
+            writeResults(received[i], bytes);
+            releaseResults(&status);
+        }
+        free(received[i]);
+    }
 
-    return nodes;
-}
+    free(buffer);
+    free(assigned);
+    free(completed);
+    free(started);
+    if (ordered) {
+        free(reorder);
+        free(reorderLengths);
+    }
 
-void teardown() {
-    MPI_Finalize();
+    return next - first;
 }
 
-void masterWorker(int argc, char *argv[], int howmany, struct params parameters, unsigned int maxsites)
+/*
+ * Called by rank 0 every time it polls for messages in vain. Rank 0 no longer generates samples while scheduling, so
+ * rather than keep a core busy, which the processes sharing it would miss, it sleeps after IDLE_POLLS polls: twice as
+ * long every time, up to IDLE_MAX_SLEEP microseconds, which bounds the delay added to any message.
+ *
+ * @param idle polls found empty in a row, reset by the caller once a message comes
+ */
+void backOff(int *idle)
 {
-    int nodes = setup(argc, argv, howmany, parameters);
+    int sleep;
 
-    // Filter out workers with rank higher than howmany, meaning there are more workers than samples to be generated.
-    if(world_rank < howmany) {
-        if (world_size == shm_size) { // There is only one node
-            int bytes;
-            singleNodeProcessing(howmany, parameters, maxsites, &bytes);
-        } else {
-            MPI_Bcast(&nodes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (*idle < IDLE_POLLS + 16)
+        (*idle)++;
+    if (*idle <= IDLE_POLLS)
+        return;
 
-            int nodeSamples = howmany / nodes;
-            int remainingGlobal = howmany % nodes;
-            int workerSamples = nodeSamples / (shm_size - 1);
-            int remainingLocal = nodeSamples % (shm_size - 1);
+    sleep = 1 << (*idle - IDLE_POLLS);
+    usleep(sleep < IDLE_MAX_SLEEP ? sleep : IDLE_MAX_SLEEP);
+}
 
-            if (world_rank != 0 && shm_rank != 0) {
-                int bytes = 0;
-                char *results = generateSamples(workerSamples, parameters, maxsites, &bytes);
+/*
+ * Writes out a batch received in a posted receive, which is posted again before the batch is released.
+ */
+void writeReceived(char **received, MPI_Request *requests, int index, MPI_Status *status)
+{
+    int bytes;
 
-                if (world_rank == shm_rank)
-                    printSamples(results, bytes);
-                else  // Send results to shm_rank = 0
-                    sendResultsToMaster(results, bytes, shmcomm);
-            } else {
-                if (world_rank != 0 && shm_rank == 0) {
-                    secondaryNodeProcessing(remainingLocal, parameters, maxsites);
-                } else
-                    principalMasterProcessing(remainingGlobal +  remainingLocal, nodes, parameters, maxsites);
-            }
-        }
-    }
+    MPI_Get_count(status, MPI_CHAR, &bytes);
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Read [%d] bytes from worker %d.\n", world_rank, bytes, status->MPI_SOURCE);
 
-    teardown();
+    writeResults(received[index], bytes);
+    MPI_Irecv(received[index], batchSize, MPI_CHAR, MPI_ANY_SOURCE, RESULTS_TAG, MPI_COMM_WORLD, &requests[index]);
+    releaseResults(status);
 }
 
-char *readResults(MPI_Comm comm, int *source, int *bytes)
+/*
+ * Size of the next chunk: half of the remaining replicates evenly divided among workers, bounded below by minChunk.
+ * After a pilot, the chunk is scaled by how fast the requesting process is compared to the average one.
+ *
+ * @param worker rank of the process asking for work
+ */
+int chunkSize(int remaining, int workers, int worker)
 {
-    MPI_Status status;
+    int size = remaining / (2 * workers);
+    double total = 0;
+    int i;
 
-    MPI_Probe(MPI_ANY_SOURCE, RESULTS_TAG, comm, &status);
-    MPI_Get_count(&status, MPI_CHAR, bytes);
-    *source = status.MPI_SOURCE;
+    if (weights != NULL) {
+        for (i = 1; i < world_size; i++)
+            total += weights[i];
+        if (total > 0)
+            size = (int) (size * weights[worker] * (world_size - 1) / total);
+    }
 
-    char *results = (char *) malloc(*bytes * sizeof(char));
+    if (size < minChunk)
+        size = minChunk;
+    if (size > remaining)
+        size = remaining;
 
-    MPI_Recv(results, *bytes, MPI_CHAR, *source, RESULTS_TAG, comm, MPI_STATUS_IGNORE);
+    return size;
+}
 
-    if (diagnose)
-        fprintf(stderr, "[%d] -> Read [%d] bytes from worker %d.\n", world_rank, *bytes, *source);
+/*
+ * Bounds a chunk to the replicates a process is expected to complete before the walltime is over, going by its
+ * throughput so far. The bound is halved so that chunks shrink as the walltime approaches and a misjudged chunk does
+ * not overrun it by much. Until a process has completed some replicates it gets one per thread.
+ *
+ * @param completed replicates completed by the process
+ * @param since when the process started on them
+ *
+ * @return size of the chunk, 0 when no replicate fits in the time left
+ */
+int budgetChunk(int chunk, int completed, double since)
+{
+    double now = MPI_Wtime();
+    double left = walltime - (now - runStart);
+    long fit;
 
-    return results;
+    if (left <= 0)
+        return 0;
+    if (completed == 0)
+        return chunk < threads ? chunk : threads;
+
+    fit = (long) (left * completed / (now - since));
+    if (fit > 1)
+        fit = (fit + 1) / 2;
+
+    return chunk < fit ? chunk : (int) fit;
 }
 
-char *generateSamples(int samples, struct params parameters, unsigned maxsites, int *bytes)
+/*
+ * Replicates a single process generates before writing them out, so that they take about batchSize bytes, going by
+ * the size of the replicates so far. The first chunk gives a replicate to every thread.
+ *
+ * @param generated bytes of the replicates produced so far
+ */
+int batchChunk(int remaining, int produced, long generated)
 {
-    char *results;
-    char *sample;
-    int length;
+    double chunk;
 
-    results = generateSample(parameters, maxsites, &length);
+    if (batchSize == 0)
+        return remaining;
 
-    *bytes = length;
+    chunk = produced == 0 || generated == 0 ? threads : (double) batchSize * produced / generated;
+    if (chunk < threads)
+        chunk = threads;
 
-    int i;
-    for (i = 1; i < samples; ++i) { // starts in 1 because a sample was already generated before the for-loop
-        sample = generateSample(parameters, maxsites, &length);
+    return chunk < remaining ? (int) chunk : remaining;
+}
+
+/*
+ * Replicates of the next round of a static split with a walltime, going by the throughput of the whole run so far.
+ * The first round gives a replicate to every thread, to measure it.
+ *
+ * @param produced replicates completed by all the processes since the start of the run
+ */
+int roundBudget(int round, int produced)
+{
+    int chunk = budgetChunk(round, produced, runStart);
 
-        results = realloc(results, *bytes + length + 2);
+    if (produced == 0 && chunk > 0)
+        chunk = round < world_size * threads ? round : world_size * threads;
 
-        memcpy(results + *bytes, sample, length);
+    return chunk;
+}
 
-        *bytes += length;
-        free(sample);
-    }
+/*
+ * Footer closing the output of a run with a walltime, which may be cut short of howmany replicates.
+ */
+char *walltimeFooter(int produced, int howmany)
+{
+    char *footer;
+
+    asprintf(&footer, "\nwalltime: %d of %d replicates\n", produced, howmany);
 
     if (diagnose)
-        fprintf(stderr, "[%d] -> Generated [%d] samples.\n", world_rank, samples);
+        fprintf(stderr, "[%d] -> Walltime: %d of %d replicates in %.3f s.\n", world_rank, produced, howmany, MPI_Wtime() - runStart);
 
-    return results;
+    return footer;
 }
 
 /*
- * Logic to generate a sample.
+ * Asks the scheduler for a new chunk of replicates.
  *
- * @param samples samples to be generated
+ * @param first index of the first replicate in the chunk
  *
- * @return the sample generated by the worker
+ * @return number of replicates in the chunk, 0 when there is no work left, -1 when the reorder window is full
  */
-char* generateSample(struct params parameters, unsigned maxsites, int *bytes)
+int requestWork(int *first)
 {
-    int segsites;
-    size_t offset, positionStrLength, gametesStrLenght;
-    double probss, tmrca, ttot;
-    char *results;
-    char **gametes;
-    struct gensam_result gensamResults;
-
-    if( parameters.mp.segsitesin ==  0 )
-        gametes = cmatrix(parameters.cp.nsam,maxsites+1);
-    else
-        gametes = cmatrix(parameters.cp.nsam, parameters.mp.segsitesin+1 );
-
-    gensamResults = gensam(gametes, &probss, &tmrca, &ttot, parameters, &segsites);
+    int chunk[2];
 
-    results = doPrintWorkerResultHeader(segsites, probss, parameters, gensamResults.tree);
+    MPI_Send(NULL, 0, MPI_INT, 0, WORK_REQUEST_TAG, MPI_COMM_WORLD);
+    MPI_Recv(chunk, 2, MPI_INT, 0, WORK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
-    offset = strlen(results);
-    *bytes = offset;
+    *first = chunk[0];
+    return chunk[1];
+}
 
+/*
+ * Generates samples chunk by chunk until the scheduler runs out of work, appending them to the batch.
+ *
+ * Every thread takes the next replicate of the current chunk as soon as it is done with the previous one, and the
+ * first thread finding the chunk exhausted asks the scheduler for a new one. MPI calls and the batch are guarded by
+ * the same critical section, so that MPI_THREAD_SERIALIZED is enough.
+ */
+void generateScheduledSamples(struct params parameters, unsigned maxsites, struct batch *batch)
+{
+    int first = 0, count = 0, exhausted = 0;
+    int samples = 0;
 
-    if(segsites > 0)
+    #pragma omp parallel num_threads(threads) reduction(+:samples)
     {
-        char *positionsStr = doPrintWorkerResultPositions(segsites, parameters.output_precision, gensamResults.positions);
-        positionStrLength = strlen(positionsStr);
-
-        char *gametesStr = doPrintWorkerResultGametes(segsites, parameters.cp.nsam, gametes);
-        gametesStrLenght = strlen(gametesStr);
-
-        results = realloc(results, offset + positionStrLength + gametesStrLenght + 2);
-
-        memcpy(results+offset, positionsStr, positionStrLength+1);
+        char *sample;
+        int length, index, retry;
+
+        seedThread();
+
+        for (;;) {
+            #pragma omp critical(mspar)
+            {
+                retry = 0;
+                if (count == 0 && !exhausted) {
+                    count = requestWork(&first);
+                    if (count < 0) { // The replicate the master waits for may be in our batch
+                        count = 0;
+                        retry = 1;
+                        if (batch->bytes > 0)
+                            flushBatch(batch, RESULTS_TAG);
+                    }
+                    exhausted = count == 0 && !retry;
+                }
+
+                index = -1;
+                if (count > 0) {
+                    index = first++;
+                    count--;
+                }
+            }
 
-        offset += positionStrLength;
-        *bytes += positionStrLength;
+            if (retry) {
+                usleep(1000);
+                continue;
+            }
 
-        memcpy(results+offset, gametesStr, gametesStrLenght+1);
+            if (index < 0)
+                break;
+
+            if (binaryWire)
+                sample = generateRecord(parameters, maxsites, index, &length);
+            else
+                sample = generateSample(parameters, maxsites, index, &length);
+            if (ordered) {
+                if (gz) // Written one by one by rank 0, so compressed one by one
+                    sample = compressSample(sample, &length);
+                sample = frameSample(index, sample, &length);
+            }
 
-        *bytes += gametesStrLenght;
+            #pragma omp critical(mspar)
+            addToBatch(batch, sample, length);
 
-        free(positionsStr);
-        free(gametesStr);
-        if( parameters.mp.timeflag ) {
-            free(gensamResults.tree);
+            free(sample);
+            samples++;
         }
     }
 
-    return results;
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Generated [%d] samples.\n", world_rank, samples);
 }
 
-
 /*
- * Prints the number of segregation sites:
- *    \n
- *    // xxx.x xx.xx x.xxxx x.xxxx
- *    segsites: xxx
+ * -gz: compresses a sample into BGZF blocks of its own.
+ *
+ * @return the compressed sample, replacing (and freeing) the sample
  */
-char *doPrintWorkerResultHeader(int segsites, double probss, struct params pars, char *treeOutput){
-    char *results;
-
-    int length = 3 + 1; // initially "\n//" and optionally a "\n" when there is no treeOutput;
-    if( (segsites > 0 ) || ( pars.mp.theta > 0.0 ) )
-    {
-        length += 21; // "segsites: " + estimation of segsites digits + CR/LF
-        if (!pars.mp.treeflag)
-            asprintf(&treeOutput, "\n");
+char *compressSample(char *sample, int *length)
+{
+    long bytes;
+    char *compressed = compressOutput(sample, *length, gz, &bytes);
 
-        length += strlen(treeOutput);
+    free(sample);
+    *length = bytes;
+    return compressed;
+}
 
-        if( (pars.mp.segsitesin > 0 ) && ( pars.mp.theta > 0.0 ))
-            length += 17; // "prob: " + estimation of probss digits + CR/LF
-    }
-    results = malloc(sizeof(char)*length);
+/*
+ * -gz: compresses the batch, which then holds its BGZF blocks. Rank 0 writes them as they are.
+ */
+void compressBatch(struct batch *batch)
+{
+    long bytes;
+    char *compressed;
 
-    sprintf(results, "\n//");
+    if (gz == 0 || batch->bytes == 0)
+        return;
 
-    if( (segsites > 0 ) || ( pars.mp.theta > 0.0 ) ) {
-        sprintf(results, "%s%s", results, treeOutput);
+    compressed = compressOutput(batch->data, batch->bytes, gz, &bytes);
+    free(batch->data);
+    batch->data = compressed;
+    batch->bytes = batch->capacity = bytes;
+}
 
-        if( (pars.mp.segsitesin > 0 ) && ( pars.mp.theta > 0.0 ))
-            sprintf(results, "%sprob: %g\n", results, probss);
+/*
+ * Prefixes a sample with its replicate index and length, so that the master can write it in order.
+ *
+ * @return the framed sample, replacing (and freeing) the sample
+ */
+char *frameSample(int index, char *sample, int *length)
+{
+    int frame[2] = { index, *length };
+    char *framed = malloc(sizeof(frame) + *length);
 
-        sprintf(results, "%ssegsites: %d\n", results, segsites);
-    }
+    memcpy(framed, frame, sizeof(frame));
+    memcpy(framed + sizeof(frame), sample, *length);
+    free(sample);
 
-    return results;
+    *length += sizeof(frame);
+    return framed;
 }
 
 /*
- * Prints the segregation site positions:
- *      positions: 0.xxxxx 0.xxxxx .... etc.
+ * Pilot phase: every process times the same replicates with all its threads and the throughputs are gathered by all
+ * processes, which weigh their share of the work with them (see replicateShare and chunkSize). Pilot samples are
+ * thrown away.
+ *
+ * @param writer whether the process also collects or writes the output of others, which discounts its throughput
  */
-char *doPrintWorkerResultPositions(int segsites, int output_precision, double *positions){
-    int i;
-    size_t offset;
+void runPilot(struct params parameters, unsigned maxsites, int writer)
+{
+    long bytes;
+    double start = MPI_Wtime(), elapsed, throughput;
 
-    int positionStrLength = 3+output_precision;
-    int length = 12 + positionStrLength*segsites; // "positions: " + LF/CR + digit + decimal point + space
-    char *results = malloc(sizeof(char) * length);
+    free(generateSamples(0, pilot, parameters, maxsites, &bytes));
+    elapsed = MPI_Wtime() - start;
+    throughput = pilot / (elapsed > 0 ? elapsed : 1e-9);
+    if (writer)
+        throughput *= masterWeight;
 
-    sprintf(results, "positions: ");
-    offset = 11;
+    weights = realloc(weights, sizeof(double) * world_size);
+    MPI_Allgather(&throughput, 1, MPI_DOUBLE, weights, 1, MPI_DOUBLE, MPI_COMM_WORLD);
 
-    char *positionStr = malloc(sizeof(char) * positionStrLength);
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Pilot: %d replicates in %.3f s, weight %.2f replicates/s.\n", world_rank, pilot, elapsed, throughput);
+}
+
+/*
+ * Number of replicates of the calling process when howmany replicates are split among all of them, evenly (rank 0
+ * taking the remainder) or, after a pilot, in proportion to their throughput.
+ */
+int replicateShare(int howmany)
+{
+    double total = 0, before = 0;
+    int i, start, end;
 
-    for(i=0; i<segsites; i++){
-        sprintf(positionStr, "%6.*lf ", output_precision, positions[i]);
-        memcpy(results+offset, positionStr, positionStrLength+1);
-        offset += positionStrLength;
+    if (weights == NULL)
+        return howmany / world_size + (world_rank == 0 ? howmany % world_size : 0);
+
+    for (i = 0; i < world_size; i++) {
+        total += weights[i];
+        if (i < world_rank)
+            before += weights[i];
     }
+    if (total <= 0) // Only writers, with no weight left for samples
+        return howmany / world_size + (world_rank == 0 ? howmany % world_size : 0);
 
-    free(positionStr);
+    // Every process rounds the same bounds, so shares add up to howmany
+    start = (int) (howmany * (before / total));
+    end = world_rank == world_size - 1 ? howmany : (int) (howmany * ((before + weights[world_rank]) / total));
 
-    return results;
+    return end - start;
 }
 
 /*
- * Print the gametes
+ * Seeds the RNG of the calling thread with the seeds of the process. Every sample then selects its own stream.
  */
-char *doPrintWorkerResultGametes(int segsites, int nsam, char **gametes){
-    int i;
-    size_t offset;
+void seedThread()
+{
+    ranrestore(&processStream);
+}
 
-    int gameteStrLength = segsites+1;
-    int resultsLength = 1 + gameteStrLength*nsam; // LF/CR + (segsites + LF/CR)
-    char *results = malloc(sizeof(char) * resultsLength);
-    sprintf(results, "\n");
-    offset=1;
+/*
+ * Appends a sample to the batch, sending the batch first when the sample does not fit in it.
+ * A sample larger than the batch size is sent on its own. When writing to a file the batch is never sent: it
+ * keeps growing until the collective write at the end of the run.
+ */
+void addToBatch(struct batch *batch, const char *sample, int length)
+{
+    // Unbounded batches are still sent in messages of at most MAX_MESSAGE bytes
+    long limit = batchSize > 0 ? batchSize : MAX_MESSAGE;
 
-    char *gameteStr = malloc(sizeof(char) * gameteStrLength * nsam);
+    if (outputFile == NULL && batch->bytes > 0 && batch->bytes + length > limit)
+        flushBatch(batch, RESULTS_TAG);
 
-    for(i=0;i<nsam; i++) {
-        sprintf(gameteStr, "%s\n ", gametes[i]);
-        memcpy(results+offset, gameteStr, gameteStrLength+2);
-        offset += gameteStrLength;
+    if (batch->slabs[0] != NULL && length > batchSize) { // Does not fit in a slab, goes as a message of its own
+        MPI_Send(sample, length, MPI_CHAR, node_master, LARGE_RESULTS_TAG, MPI_COMM_WORLD);
+        MPI_Recv(NULL, 0, MPI_INT, node_master, ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        return;
     }
 
-    return results;
-}
+    if (batch->bytes + length > batch->capacity) {
+        batch->capacity = batch->bytes + length;
+        if (outputFile == NULL && batchSize > 0 && batch->capacity < batchSize)
+            batch->capacity = batchSize;
+        else if (batch->capacity < 2 * batch->bytes)
+            batch->capacity = 2 * batch->bytes;
+        batch->data = realloc(batch->data, batch->capacity);
+    }
 
-// **************************************  //
-// UTILS
-// **************************************  //
+    memcpy(batch->data + batch->bytes, sample, length);
+    batch->bytes += length;
+}
 
-/*--------------------------------------------------------------
- *
- *  DESCRIPTION: (Append strings)  CMS
- *
- *    Given two strings, lhs and rhs, the rhs string is appended
- *    to the lhs string, which can later on can be safely accessed
- *    by the caller of this function.
- *
- *  ARGUMENTS:
- *
- *    lhs - The left hand side string
- *    rhs - The right hand side string
- *
- *  RETURNS:
- *    A pointer to the new string (rhs appended to lhs)
+/*
+ * Starts sending the batch to the master and goes on filling the other buffer, so that a batch travels while the
+ * next one is generated. The other buffer is reused once its own send is over and at most one batch is left
+ * unacknowledged, which bounds the number of batches a worker can pile up at the master to two.
  *
- *------------------------------------------------------------*/
-char *append(char *lhs, const char *rhs)
+ * @param tag RESULTS_TAG, or LAST_RESULTS_TAG for the final (possibly empty) batch of the worker
+ */
+void flushBatch(struct batch *batch, int tag)
 {
-    const size_t len1 = strlen(lhs);
-    const size_t len2 = strlen(rhs);
-    const size_t newSize = len1 + len2 + 1; //+1 because of the terminating null
+    int current = batch->buffer;
+
+    if (batch->slabs[0] != NULL) {
+        flushSlab(batch, tag);
+        return;
+    }
+
+    if (!ordered) // Ordered samples are compressed one by one
+        compressBatch(batch);
+    if (tag == RESULTS_TAG)
+        tag = resultsTag(batch->bytes);
+    MPI_Isend(batch->data, batch->bytes, MPI_CHAR, 0, tag, MPI_COMM_WORLD, &batch->requests[current]);
+    batch->sending[current] = 1;
+    batch->pending += (tag != LAST_RESULTS_TAG);
 
-    char *const buffer = malloc(newSize);
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Sending [%ld] bytes to master in MPI_COMM_WORLD.\n", world_rank, batch->bytes);
 
-    strcpy(buffer, lhs);
-    strcpy(buffer+len1, rhs);
+    batch->buffers[current] = batch->data;
+    batch->capacities[current] = batch->capacity;
+    batch->buffer = 1 - current;
 
-    return buffer;
+    while (batch->pending > (tag == LAST_RESULTS_TAG ? 0 : 1)) {
+        MPI_Recv(NULL, 0, MPI_INT, 0, ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        batch->pending--;
+    }
+    if (batch->sending[batch->buffer])
+        MPI_Wait(&batch->requests[batch->buffer], MPI_STATUS_IGNORE);
+    if (tag == LAST_RESULTS_TAG)
+        MPI_Wait(&batch->requests[current], MPI_STATUS_IGNORE);
+    batch->sending[batch->buffer] = 0;
+
+    batch->data = batch->buffers[batch->buffer];
+    batch->capacity = batch->capacities[batch->buffer];
+    batch->bytes = 0;
 }
 
 /*
- * doInitializeRng - Initializes the Random Number Generator
- * @argc number of arguments passed to the program
- * @argv array holding the arguments passed to the program
- *
- * Reads the RGN seeds from command arguments and use them for initialize
- * the RGN that will generate the seeds that worker process will use
- * for initialize their own RGN.
+ * Hands the slab being filled over to the node master, which reads it in place, and goes on with the other slab
+ * as soon as the node master releases it. Slabs are released in the order they were handed over.
  *
- * This function must be called by the master process located at the
- * main node only.
+ * @param tag RESULTS_TAG, or LAST_RESULTS_TAG for the final (possibly empty) slab of the worker
  */
-int doInitializeRng(int argc, char *argv[])
+void flushSlab(struct batch *batch, int tag)
 {
-    int arg = 0;
-    int result = 0;
+    int notice[3] = { shm_rank, batch->slab, batch->bytes };
 
-    while(arg < argc){
-        switch(argv[arg++][1]){
-        case 's':
-            if(argv[arg-1][2] == 'e')
-                commandlineseed(argv+arg);
-            break;
-        default:
-            continue;
-        }
+    MPI_Send(notice, 3, MPI_INT, node_master, tag == RESULTS_TAG ? SLAB_TAG : LAST_SLAB_TAG, MPI_COMM_WORLD);
+    batch->slabPending[batch->slab] = 1;
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Handed [%ld] bytes over to node master %d.\n", world_rank, batch->bytes, node_master);
+
+    batch->slab = 1 - batch->slab;
+    if (batch->slabPending[batch->slab]) {
+        MPI_Recv(NULL, 0, MPI_INT, node_master, SLAB_ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        batch->slabPending[batch->slab] = 0;
     }
 
-    return result;
+    batch->data = batch->slabs[batch->slab];
+    batch->bytes = 0;
 }
 
-void initializeSeedMatrix(int argc, char *argv[], int howmany) {
-    int i;
-    int size = world_size;
+/*
+ * Receives the results announced by a probed message: either the message itself, or the slab of a worker in the
+ * same node, which is read in place from the shared window.
+ *
+ * @param buffer receive buffer for messages, grown as needed
+ *
+ * @return the results, valid until releaseResults is called
+ */
+char *receiveResults(MPI_Status *status, int *bytes, char **buffer, int *capacity)
+{
+    int notice[3];
+    int disp_unit;
+    MPI_Aint size;
+    char *slab;
 
-    // If there are (not likely) more processes than samples, then the process pool
-    // is cut up to the number of samples. */
-    if(world_size > howmany)
-        size = howmany + 1; // the extra 1 is due to the master
+    if (status->MPI_TAG == SLAB_TAG || status->MPI_TAG == LAST_SLAB_TAG) {
+        MPI_Recv(notice, 3, MPI_INT, status->MPI_SOURCE, status->MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Win_shared_query(slabs, notice[0], &size, &disp_unit, &slab);
 
-    int dimension = 3 * size;
-    unsigned short *seedMatrix = (unsigned short *) malloc(sizeof(unsigned short) * dimension);
+        *bytes = notice[2];
+        return slab + notice[1] * batchSize;
+    }
 
-    if (world_rank == 0) {
-        doInitializeRng(argc, argv);
+    MPI_Get_count(status, MPI_CHAR, bytes);
+    if (*bytes > *capacity) {
+        *capacity = *bytes;
+        *buffer = realloc(*buffer, *capacity);
+    }
+    MPI_Recv(*buffer, *bytes, MPI_CHAR, status->MPI_SOURCE, status->MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Read [%d] bytes from worker %d.\n", world_rank, *bytes, status->MPI_SOURCE);
 
-        for(i=0; i<dimension;i++)
-            seedMatrix[i] = (unsigned short) (ran1()*100000);
+    return *buffer;
+}
 
-    }
+/*
+ * Tag of a message of results: RESULTS_TAG when they fit in the receives posted by the master.
+ */
+int resultsTag(int bytes)
+{
+    return bytes <= batchSize ? RESULTS_TAG : LARGE_RESULTS_TAG;
+}
 
-    unsigned short localSeedMatrix[3];
-    MPI_Scatter(seedMatrix, 3, MPI_UNSIGNED_SHORT, localSeedMatrix, 3, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
+/*
+ * Lets the sender of some results know they have been consumed.
+ *
+ * @return 1 when those were the last results of the sender, 0 otherwise
+ */
+int releaseResults(MPI_Status *status)
+{
+    if (status->MPI_TAG == SLAB_TAG)
+        MPI_Send(NULL, 0, MPI_INT, status->MPI_SOURCE, SLAB_ACK_TAG, MPI_COMM_WORLD);
+    else if (status->MPI_TAG == RESULTS_TAG || status->MPI_TAG == LARGE_RESULTS_TAG)
+        MPI_Send(NULL, 0, MPI_INT, status->MPI_SOURCE, ACK_TAG, MPI_COMM_WORLD);
 
-    if (world_rank != 0)
-        seed48(localSeedMatrix);
-}
\ No newline at end of file
+    return status->MPI_TAG == LAST_SLAB_TAG || status->MPI_TAG == LAST_RESULTS_TAG;
+}
+
+/*
+ * Node master of a secondary node: instead of generating samples, forwards to the global master the slabs filled by
+ * the workers of the node, sending them straight from the shared window.
+ */
+void relayNodeResults()
+{
+    int sources = shm_size - 1;
+    int pending = 0;
+    int bytes, capacity = 0;
+    char *results, *buffer = NULL;
+    MPI_Status status;
+
+    while (sources > 0) {
+        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+
+        if (status.MPI_TAG == ACK_TAG) {
+            MPI_Recv(NULL, 0, MPI_INT, 0, ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            pending = 0;
+            continue;
+        }
+
+        results = receiveResults(&status, &bytes, &buffer, &capacity);
+        if (bytes > 0) {
+            if (pending)
+                MPI_Recv(NULL, 0, MPI_INT, 0, ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            MPI_Send(results, bytes, MPI_CHAR, 0, resultsTag(bytes), MPI_COMM_WORLD);
+            pending = 1;
+
+            if (diagnose)
+                fprintf(stderr, "[%d] -> Forwarded [%d] bytes from worker %d to master.\n", world_rank, bytes, status.MPI_SOURCE);
+        }
+
+        if (releaseResults(&status))
+            sources--;
+    }
+
+    if (pending)
+        MPI_Recv(NULL, 0, MPI_INT, 0, ACK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Send(NULL, 0, MPI_CHAR, 0, LAST_RESULTS_TAG, MPI_COMM_WORLD);
+
+    free(buffer);
+}
+
+void writeResults(const char *results, long bytes)
+{
+    long offset;
+    int recordBytes;
+
+    if (ordered)
+        reorderResults(results, bytes);
+    else if (!binaryWire) {
+        indexOutput(results, bytes);
+        writeOutput(results, bytes);
+    } else {
+        for (offset = 0; offset < bytes; offset += recordBytes) {
+            memcpy(&recordBytes, results + offset, sizeof(int));
+            writeSample(results + offset, recordBytes);
+        }
+    }
+
+    fflush(stdout);
+}
+
+/*
+ * Writes out a single sample, formatting it first when it is a binary record.
+ */
+void writeSample(const char *sample, int length)
+{
+    char *text;
+
+    if (!binaryWire) {
+        indexOutput(sample, length);
+        writeOutput(sample, length);
+        return;
+    }
+
+    text = formatRecord(sample, recordParameters, &length);
+    if (writerRunning) {
+        queueOutput(text, length);
+        return;
+    }
+    fwrite(text, sizeof(char), length, stdout);
+    free(text);
+}
+
+/*
+ * -format bin: adds the records about to be written to stdout by rank 0 to the index.
+ */
+void indexOutput(const char *records, long bytes)
+{
+    if (format == FORMAT_BIN)
+        addBinRecords(&binIndex, records, bytes, outputOffset);
+    outputOffset += bytes;
+}
+
+/*
+ * Closes the output of rank 0 on stdout: the index with -format bin, or the walltime footer with -walltime, followed
+ * by the empty block ending compressed output.
+ *
+ * @param produced replicates written out
+ */
+void closeOutput(int produced, int howmany)
+{
+    char *footer;
+    long bytes;
+
+    if (format == FORMAT_BIN) {
+        footer = binIndexFooter(&binIndex, &bytes);
+        printSamples(footer, bytes);
+    } else if (walltime > 0) {
+        footer = walltimeFooter(produced, howmany);
+        bytes = strlen(footer);
+        footer = compressResults(footer, &bytes);
+        printSamples(footer, bytes);
+    }
+
+    if (gz) {
+        footer = compressedEnd(&bytes);
+        printSamples(footer, bytes);
+    }
+}
+
+/*
+ * -gz: compresses results written out by rank 0.
+ *
+ * @param bytes size of the results, updated to the size of the compressed results
+ *
+ * @return the results, compressed (and freed) with -gz
+ */
+char *compressResults(char *results, long *bytes)
+{
+    char *compressed;
+
+    if (gz == 0)
+        return results;
+
+    compressed = compressOutput(results, *bytes, gz, bytes);
+    free(results);
+    return compressed;
+}
+
+/*
+ * Ordered output: writes the framed samples of some results in replicate order. A sample arriving ahead of its turn
+ * waits in the reorder window, which replicates never overrun since the scheduler does not hand them out beyond it.
+ */
+void reorderResults(const char *results, long bytes)
+{
+    long offset;
+    int slot, frame[2];
+
+    for (offset = 0; offset < bytes; offset += sizeof(frame) + frame[1]) {
+        memcpy(frame, results + offset, sizeof(frame));
+
+        if (frame[0] != nextToWrite) {
+            slot = frame[0] % orderWindow;
+            reorder[slot] = malloc(frame[1]);
+            memcpy(reorder[slot], results + offset + sizeof(frame), frame[1]);
+            reorderLengths[slot] = frame[1];
+            continue;
+        }
+
+        writeSample(results + offset + sizeof(frame), frame[1]);
+        nextToWrite++;
+
+        for (slot = nextToWrite % orderWindow; reorder[slot] != NULL; slot = nextToWrite % orderWindow) {
+            writeSample(reorder[slot], reorderLengths[slot]);
+            free(reorder[slot]);
+            reorder[slot] = NULL;
+            nextToWrite++;
+        }
+    }
+}
+
+/*
+ * Within a node, batches are written into slabs of a shared window which the node master reads in place: the global
+ * master writes them out, other node masters forward them. Each node master is then in charge of its node instead of
+ * generating samples. Nodes with a single process, or unbounded batches, send batches as messages to the global master.
+ * A run with a single process writes out its replicates in chunks of about batchSize bytes (see batchChunk).
+ */
+void dynamicProcessing(int howmany, struct params parameters, unsigned int maxsites)
+{
+    long bytes;
+    char *results, *base;
+    struct batch batch = { 0 };
+    int useSlabs = batchSize > 0 && shm_size > 1 && !gz; // Compressed batches are messages, smaller than the slabs
+    int role[2], totals[2]; // threads generating samples, sends results to the global master
+    int produced, samples;
+    long generated = 0;
+
+    if (world_size == 1) {
+        for (produced = 0; produced < howmany; produced += samples) {
+            samples = batchChunk(howmany - produced, produced, generated);
+            if (walltime > 0)
+                samples = budgetChunk(samples, produced, runStart);
+            if (samples == 0)
+                break;
+            results = generateSamples(produced, samples, parameters, maxsites, &bytes);
+            generated += bytes;
+            indexOutput(results, bytes);
+            results = compressResults(results, &bytes);
+            printSamples(results, bytes);
+        }
+        closeOutput(produced, howmany);
+        return;
+    }
+
+    role[0] = world_rank != 0 && !(useSlabs && shm_rank == 0) ? threads : 0;
+    role[1] = world_rank != 0 && !(useSlabs && node_master != 0 && shm_rank != 0);
+    MPI_Reduce(role, totals, 2, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (useSlabs) {
+        MPI_Win_allocate_shared(shm_rank == 0 ? 0 : 2 * batchSize, sizeof(char), MPI_INFO_NULL, shmcomm, &base, &slabs);
+        batch.slabs[0] = batch.data = base;
+        batch.slabs[1] = base + batchSize;
+        batch.capacity = batchSize;
+    }
+
+    if (world_rank == 0) {
+        produced = scheduleReplicates(0, howmany, totals[0], totals[1]);
+        closeOutput(produced, howmany);
+    } else if (useSlabs && shm_rank == 0)
+        relayNodeResults();
+    else {
+        generateScheduledSamples(parameters, maxsites, &batch);
+        flushBatch(&batch, LAST_RESULTS_TAG);
+        if (!useSlabs) {
+            free(batch.buffers[0]);
+            free(batch.buffers[1]);
+        }
+    }
+
+    if (useSlabs)
+        MPI_Win_free(&slabs);
+}
+
+// **************************************  //
+// WRITER THREAD
+// **************************************  //
+
+/*
+ * Starts the writer thread of rank 0, which takes over stdout: from then on, output goes through writeOutput,
+ * queueOutput or printSamples only, until stopWriter. Rank 0 is then free to receive and format results, or to
+ * generate its own samples, while the output is written.
+ */
+void startWriter()
+{
+    fflush(stdout);
+    queueHead = queueTail = 0;
+    if (pthread_create(&writer, NULL, writeQueuedOutput, NULL) != 0) {
+        fprintf(stderr, "Unable to start the writer thread, writing from rank 0.\n");
+        return;
+    }
+    writerRunning = 1;
+}
+
+/*
+ * Waits for the writer thread to write out everything queued.
+ */
+void stopWriter()
+{
+    if (!writerRunning)
+        return;
+
+    queueOutput(NULL, 0);
+    pthread_join(writer, NULL);
+    writerRunning = 0;
+}
+
+/*
+ * Hands a buffer over to the writer thread, waiting while the queue is full. The buffer is freed once written.
+ *
+ * @param data the buffer, NULL to stop the writer
+ */
+void queueOutput(char *data, long bytes)
+{
+    pthread_mutex_lock(&queueLock);
+    while (queueTail - queueHead == WRITER_QUEUE)
+        pthread_cond_wait(&queueChanged, &queueLock);
+
+    writerQueue[queueTail % WRITER_QUEUE].data = data;
+    writerQueue[queueTail % WRITER_QUEUE].bytes = bytes;
+    queueTail++;
+    pthread_cond_signal(&queueChanged);
+    pthread_mutex_unlock(&queueLock);
+}
+
+/*
+ * Writes out some output which is not ours to keep: it is copied for the writer thread, if any.
+ */
+void writeOutput(const char *data, long bytes)
+{
+    char *copy;
+
+    if (!writerRunning) {
+        fwrite(data, sizeof(char), bytes, stdout);
+        return;
+    }
+
+    copy = malloc(bytes);
+    memcpy(copy, data, bytes);
+    queueOutput(copy, bytes);
+}
+
+/*
+ * Writer thread: writes the queued buffers in order straight to the stdout file descriptor. Small buffers (e.g.
+ * single samples) are gathered into blocks of WRITE_BLOCK bytes, which are written once full or when the queue runs
+ * dry; larger ones are written as they are. Once a write fails (e.g. the reader went away) the rest is dropped.
+ */
+void *writeQueuedOutput(void *unused)
+{
+    char *block = malloc(WRITE_BLOCK);
+    long blocked = 0;
+    int failed = 0;
+    struct output output;
+
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        if (queueHead == queueTail && blocked > 0) { // Write out the block before waiting
+            pthread_mutex_unlock(&queueLock);
+            failed = failed || !writeFully(STDOUT_FILENO, block, blocked);
+            blocked = 0;
+            continue;
+        }
+        while (queueHead == queueTail)
+            pthread_cond_wait(&queueChanged, &queueLock);
+
+        output = writerQueue[queueHead % WRITER_QUEUE];
+        queueHead++;
+        pthread_cond_signal(&queueChanged);
+        pthread_mutex_unlock(&queueLock);
+
+        if (output.data == NULL)
+            break;
+
+        if (blocked > 0 && blocked + output.bytes > WRITE_BLOCK) {
+            failed = failed || !writeFully(STDOUT_FILENO, block, blocked);
+            blocked = 0;
+        }
+        if (output.bytes >= WRITE_BLOCK / 2)
+            failed = failed || !writeFully(STDOUT_FILENO, output.data, output.bytes);
+        else {
+            memcpy(block + blocked, output.data, output.bytes);
+            blocked += output.bytes;
+        }
+        free(output.data);
+    }
+
+    if (blocked > 0 && !failed)
+        writeFully(STDOUT_FILENO, block, blocked);
+    free(block);
+
+    return NULL;
+}
+
+/*
+ * @return 1 once every byte has been written, 0 if a write failed
+ */
+int writeFully(int fd, const char *data, long bytes)
+{
+    ssize_t written;
+
+    for (; bytes > 0; data += written, bytes -= written) {
+        if ((written = write(fd, data, bytes)) < 0 && errno != EINTR)
+            return 0;
+        if (written < 0)
+            written = 0;
+    }
+
+    return 1;
+}
+
+// **************************************  //
+// MPI-IO OUTPUT
+// **************************************  //
+
+/*
+ * Every process generates its replicates (dynamically or statically assigned) into a single block, and all blocks
+ * are written to the output file at once. Blocks are laid out in rank order, the global master's block being the
+ * header, so the file is the same as gathering the blocks in rank order and printing them.
+ *
+ * With checkpoints, replicates are generated and written in rounds of checkpointInterval replicates instead, every
+ * round being recorded once it is safely in the file. A resumed run starts over from the last recorded round.
+ *
+ * With a walltime, rounds end early once it is over, and the run ends with the first round left empty. Without the
+ * scheduler (a single process, or the static split of ordered output), rank 0 sizes every round after the replicates
+ * the processes are expected to complete together in the time left (see roundBudget).
+ *
+ * With -format bin, every process keeps the offsets of its records, which rank 0 gathers into the index closing the
+ * file.
+ */
+void fileProcessing(int howmany, struct params parameters, unsigned int maxsites)
+{
+    struct batch batch = { 0 };
+    char *sample;
+    int samples, first, length, i, done, round;
+    int produced = 0;
+    long skip = 0, bytes;
+    MPI_Offset offset, blockStart;
+    MPI_File file = openOutputFile(parameters.resume, &done, &offset);
+
+    if (world_rank == 0 && offset == 0) {
+        addToBatch(&batch, header, headerBytes);
+        skip = headerBytes;
+    }
+    if (world_rank == 0 && offset > 0 && format == FORMAT_BIN) // Records of the resumed run
+        indexFile(file, offset);
+
+    for (; done < howmany; done += round) {
+        round = checkpointInterval > 0 && checkpointInterval < howmany - done ? checkpointInterval : howmany - done;
+
+        if (dynamic && world_size > 1) {
+            if (world_rank == 0)
+                round = scheduleReplicates(done, round, world_size - 1, world_size - 1);
+            else
+                generateScheduledSamples(parameters, maxsites, &batch);
+            if (walltime > 0) // The round may have been cut short
+                MPI_Bcast(&round, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        } else {
+            if (walltime > 0) {
+                if (world_rank == 0)
+                    round = roundBudget(round, produced);
+                MPI_Bcast(&round, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            }
+            samples = replicateShare(round);
+            first = done + firstReplicate(samples);
+
+            for (i = 0; i < samples; i++) {
+                sample = generateSample(parameters, maxsites, first + i, &length);
+                addToBatch(&batch, sample, length);
+                free(sample);
+            }
+        }
+
+        compressBatch(&batch);
+        offset = writeResultsToFile(file, offset, batch.data, batch.bytes, &blockStart);
+        if (format == FORMAT_BIN)
+            addBinRecords(&binIndex, batch.data + skip, batch.bytes - skip, blockStart + skip);
+        batch.bytes = skip = 0;
+
+        if (round == 0) // Out of walltime
+            break;
+        if (checkpointInterval > 0)
+            writeCheckpoint(file, done + round, offset);
+        produced += round;
+    }
+
+    if (format == FORMAT_BIN)
+        gatherBinIndex(&batch);
+    else if (walltime > 0 && world_rank == 0) {
+        sample = walltimeFooter(done, howmany);
+        addToBatch(&batch, sample, strlen(sample));
+        free(sample);
+    }
+    compressBatch(&batch);
+    if (gz && world_rank == 0) {
+        sample = compressedEnd(&bytes);
+        addToBatch(&batch, sample, bytes);
+        free(sample);
+    }
+    if (format == FORMAT_BIN || walltime > 0 || gz)
+        writeResultsToFile(file, offset, batch.data, batch.bytes, &blockStart);
+
+    MPI_File_close(&file);
+    free(batch.data);
+}
+
+/*
+ * Opens the output file, which is emptied unless the run resumes, along with its checkpoints. A resumed run goes on
+ * from its last checkpoint: whatever was written after it is cut off.
+ *
+ * @param done number of replicates already in the file
+ * @param offset size of the file
+ */
+MPI_File openOutputFile(int resume, int *done, MPI_Offset *offset)
+{
+    MPI_File file;
+    MPI_Offset size;
+    MPI_Offset checkpoint[2] = { 0, 0 }; // replicates, offset
+    char *path;
+
+    // A resumed run reads the records already in the file to index them (-format bin)
+    if (MPI_File_open(MPI_COMM_WORLD, outputFile, MPI_MODE_CREATE | (resume ? MPI_MODE_RDWR : MPI_MODE_WRONLY),
+                      MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        if (world_rank == 0)
+            fprintf(stderr, "Unable to open output file %s\n", outputFile);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (resume && world_rank == 0) {
+        checkpoint[0] = readCheckpoint(&checkpoint[1]);
+        MPI_File_get_size(file, &size);
+        if (size < checkpoint[1]) {
+            fprintf(stderr, "Output file %s is shorter than its checkpoint (%lld bytes)\n", outputFile, (long long) checkpoint[1]);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    if (!resume && world_rank == 0) { // Checkpoints of a previous run no longer apply
+        asprintf(&path, "%s.ckpt", outputFile);
+        remove(path);
+        free(path);
+    }
+    MPI_Bcast(checkpoint, 2, MPI_OFFSET, 0, MPI_COMM_WORLD);
+
+    MPI_File_set_size(file, checkpoint[1]);
+    *done = checkpoint[0];
+    *offset = checkpoint[1];
+
+    if (diagnose && world_rank == 0 && resume)
+        fprintf(stderr, "[%d] -> Resuming after replicate %d at offset %lld of %s.\n", world_rank, *done, (long long) *offset, outputFile);
+
+    return file;
+}
+
+/*
+ * Collectively writes the block of every process into the output file. Each process writes at the sum of the sizes
+ * of the blocks held by lower ranks, computed with an exclusive prefix sum.
+ *
+ * @param offset where the first block goes
+ * @param blockStart where the block of the calling process went
+ *
+ * @return offset right after the last block
+ */
+MPI_Offset writeResultsToFile(MPI_File file, MPI_Offset offset, const char *results, long bytes, MPI_Offset *blockStart)
+{
+    MPI_Offset size = bytes;
+    MPI_Offset blockOffset = 0, total, written;
+    long calls = (bytes + MAX_MESSAGE - 1) / MAX_MESSAGE, maxCalls, i;
+
+    MPI_Exscan(&size, &blockOffset, 1, MPI_OFFSET, MPI_SUM, MPI_COMM_WORLD);
+    if (world_rank == 0) // MPI_Exscan leaves the receive buffer of the first process undefined
+        blockOffset = 0;
+
+    // Every process takes part in as many collective calls as the one with the largest block, in pieces of at most
+    // MAX_MESSAGE bytes
+    MPI_Allreduce(&calls, &maxCalls, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+    for (i = 0; i < maxCalls; i++) {
+        written = i * MAX_MESSAGE < bytes ? i * MAX_MESSAGE : bytes;
+        MPI_File_write_at_all(file, offset + blockOffset + written, results + written,
+                              bytes - written < MAX_MESSAGE ? bytes - written : MAX_MESSAGE, MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+    MPI_Allreduce(&size, &total, 1, MPI_OFFSET, MPI_SUM, MPI_COMM_WORLD);
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Wrote [%ld] bytes at offset %lld of %s.\n", world_rank, bytes, (long long) (offset + blockOffset), outputFile);
+
+    *blockStart = offset + blockOffset;
+    return offset + total;
+}
+
+/*
+ * -format bin: gathers the index entries of every process on rank 0, which puts the index into the batch.
+ */
+void gatherBinIndex(struct batch *batch)
+{
+    int count = 2 * binIndex.count, i; // entries travel as pairs of numbers
+    int *counts = NULL, *displacements = NULL;
+    struct binindex gathered = { 0 };
+    char *footer;
+    long bytes;
+
+    if (world_rank == 0) {
+        counts = malloc(sizeof(int) * world_size);
+        displacements = malloc(sizeof(int) * world_size);
+    }
+    MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (world_rank == 0) {
+        for (i = 0; i < world_size; i++)
+            displacements[i] = i > 0 ? displacements[i - 1] + counts[i - 1] : 0;
+        gathered.count = gathered.capacity = (displacements[world_size - 1] + counts[world_size - 1]) / 2;
+        gathered.entries = malloc(sizeof(struct binentry) * (gathered.count > 0 ? gathered.count : 1));
+    }
+    MPI_Gatherv(binIndex.entries, count, MPI_UNSIGNED_LONG_LONG, gathered.entries, counts, displacements,
+                MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+
+    free(binIndex.entries);
+    binIndex.entries = NULL;
+    binIndex.count = binIndex.capacity = 0;
+    if (world_rank != 0)
+        return;
+
+    footer = binIndexFooter(&gathered, &bytes);
+    addToBatch(batch, footer, bytes);
+
+    free(footer);
+    free(counts);
+    free(displacements);
+}
+
+/*
+ * -format bin: indexes the records already in the output file of a resumed run, going from record to record up to
+ * the given offset.
+ */
+void indexFile(MPI_File file, MPI_Offset end)
+{
+    unsigned int start[2]; // size and replicate index of a record
+    MPI_Offset position;
+
+    MPI_File_read_at(file, BIN_HEADER_BYTES - sizeof(int), start, sizeof(int), MPI_CHAR, MPI_STATUS_IGNORE);
+    for (position = BIN_ALIGN(BIN_HEADER_BYTES + start[0]); position < end; position += start[0]) {
+        MPI_File_read_at(file, position, start, sizeof(start), MPI_CHAR, MPI_STATUS_IGNORE);
+        addBinRecords(&binIndex, (const char *) start, sizeof(start), position);
+    }
+}
+
+/*
+ * Records that the first done replicates take the first offset bytes of the output file, once they are on disk.
+ * Checkpoints are appended as "<replicates> <offset>" lines to the file named after the output file plus ".ckpt".
+ */
+void writeCheckpoint(MPI_File file, int done, MPI_Offset offset)
+{
+    char *path;
+    FILE *checkpoint;
+
+    MPI_File_sync(file);
+    if (world_rank != 0)
+        return;
+
+    asprintf(&path, "%s.ckpt", outputFile);
+    if ((checkpoint = fopen(path, "a")) == NULL) {
+        perror(path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fprintf(checkpoint, "%d %lld\n", done, (long long) offset);
+    fflush(checkpoint);
+    fsync(fileno(checkpoint));
+    fclose(checkpoint);
+    free(path);
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Checkpoint: %d replicates in %lld bytes.\n", world_rank, done, (long long) offset);
+}
+
+/*
+ * Reads the last complete checkpoint of the output file, if any. Checkpoints are appended, so the run which was cut
+ * short may have left a torn last line: the file is rewritten with its complete lines only, before the resumed run
+ * appends its own checkpoints.
+ *
+ * @param offset size of the output file at the checkpoint
+ *
+ * @return number of replicates in the output file at the checkpoint, 0 without checkpoints
+ */
+int readCheckpoint(MPI_Offset *offset)
+{
+    char *path, *rewritten, line[64];
+    FILE *checkpoint, *kept;
+    int done = 0, replicates, complete, start = 1; // start: the line read starts a line of the file
+    long long bytes;
+
+    *offset = 0;
+    asprintf(&path, "%s.ckpt", outputFile);
+    asprintf(&rewritten, "%s.ckpt.tmp", outputFile);
+    if ((checkpoint = fopen(path, "r")) != NULL) {
+        if ((kept = fopen(rewritten, "w")) == NULL) {
+            perror(rewritten);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        while (fgets(line, sizeof(line), checkpoint) != NULL) {
+            complete = strchr(line, '\n') != NULL;
+            if (start && complete && sscanf(line, "%d %lld", &replicates, &bytes) == 2) {
+                done = replicates;
+                *offset = bytes;
+                fputs(line, kept);
+            }
+            start = complete;
+        }
+        fclose(checkpoint);
+
+        fflush(kept);
+        fsync(fileno(kept));
+        fclose(kept);
+        if (rename(rewritten, path) != 0) {
+            perror(path);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    free(rewritten);
+    free(path);
+
+    return done;
+}
+
+/*
+ * Reads the settings of the run from the environment. Settings depending on the command line are updated for every
+ * run of a server.
+ */
+void readSettings(struct params parameters)
+{
+    if (getenv("MSPARSM_DIAGNOSE")) diagnose = 1;
+    dynamic = !(getenv("MSPARSM_SCHEDULE") && strcmp(getenv("MSPARSM_SCHEDULE"), "static") == 0);
+    if (getenv("MSPARSM_MIN_CHUNK")) minChunk = atoi(getenv("MSPARSM_MIN_CHUNK"));
+    if (minChunk < 1) minChunk = 1;
+    if (getenv("MSPARSM_BATCH_SIZE") && (batchSize = parseSize(getenv("MSPARSM_BATCH_SIZE"))) < 0) {
+        if (world_rank == 0)
+            fprintf(stderr, "MSPARSM_BATCH_SIZE must be a number of bytes, optionally followed by K, M or G\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (batchSize > MAX_MESSAGE) batchSize = MAX_MESSAGE;
+    if (getenv("MSPARSM_PILOT")) pilot = atoi(getenv("MSPARSM_PILOT"));
+    if (getenv("MSPARSM_MASTER_WEIGHT")) masterWeight = atof(getenv("MSPARSM_MASTER_WEIGHT"));
+    if (masterWeight < 0) masterWeight = 0;
+    if (getenv("MSPARSM_FAN_IN")) fanIn = atoi(getenv("MSPARSM_FAN_IN"));
+    if (fanIn < 1) fanIn = 1;
+    if (getenv("MSPARSM_CHECKPOINT")) checkpointInterval = atoi(getenv("MSPARSM_CHECKPOINT"));
+    if (checkpointInterval < 0) checkpointInterval = 0;
+    ordered = getenv("MSPARSM_ORDER") && strcmp(getenv("MSPARSM_ORDER"), "index") == 0;
+    if (getenv("MSPARSM_ORDER_WINDOW")) orderWindow = atoi(getenv("MSPARSM_ORDER_WINDOW"));
+    if (orderWindow < 1) orderWindow = 1;
+    // Ordered output needs a single writer: the scheduler on stdout, or a split of consecutive replicates in rank
+    // order with -o. So does a server, writing to its client.
+    if (ordered)
+        dynamic = parameters.outputfile == NULL;
+    if (serving && parameters.outputfile == NULL)
+        dynamic = 1;
+    // The walltime is kept by the scheduler, or by rank 0 sizing the rounds of the static split of ordered output to
+    // a file. Nor can the index of binary output be built on stdout but by rank 0 writing everything out.
+    // Compressed blocks are not to be interleaved on stdout either.
+    if ((parameters.walltime > 0 || parameters.format == FORMAT_BIN || parameters.gz > 0)
+        && !(ordered && parameters.outputfile != NULL))
+        dynamic = 1;
+    // Records only travel in dynamic mode, when rank 0 writes everything out. Binary output is compact already, and
+    // compressed output is compressed by the workers.
+    binaryWire = getenv("MSPARSM_WIRE") && strcmp(getenv("MSPARSM_WIRE"), "binary") == 0
+                 && dynamic && parameters.outputfile == NULL && parameters.format == FORMAT_TEXT && parameters.gz == 0;
+
+    writerThread = getenv("MSPARSM_WRITER") && strcmp(getenv("MSPARSM_WRITER"), "thread") == 0;
+    if (getenv("MSPARSM_MASTER_MAX_NODES")) masterMaxNodes = atoi(getenv("MSPARSM_MASTER_MAX_NODES"));
+    if (masterMaxNodes < 0) masterMaxNodes = 0;
+
+    if (getenv("MSPARSM_THREADS")) threads = atoi(getenv("MSPARSM_THREADS"));
+    if (threads < 1) threads = 1;
+    if (getenv("MSPARSM_SEGMENT_THREADS")) segmentThreads = atoi(getenv("MSPARSM_SEGMENT_THREADS"));
+    if (segmentThreads < 1) segmentThreads = 1;
+#ifdef _OPENMP
+    if (threads > 1 && segmentThreads > 1) omp_set_max_active_levels(2);
+#endif
+}
+
+/*
+ * Initializes MPI and the communicators, once for all the runs of the process.
+ *
+ * @return number of nodes, only known by rank 0
+ */
+int initializeMPI(int argc, char *argv[])
+{
+    // MPI Initialization. Threads only call MPI from within a critical section.
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    // MPI_COMM_TYPE_SHARED: This type splits the communicator into subcommunicators, each of which can create a shared memory region.
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shmcomm);
+    MPI_Comm_size(shmcomm, &shm_size);
+    MPI_Comm_rank(shmcomm, &shm_rank);
+    node_master = world_rank;
+    MPI_Bcast(&node_master, 1, MPI_INT, 0, shmcomm);
+
+    checkThreadSupport();
+
+    int nodes = calculateNumberOfNodes();
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> SHM Rank=%d, SHM Size=%d, WORLD Size=%d\n", world_rank, shm_rank, shm_size, world_size);
+
+    if(diagnose && world_rank == 0)
+        fprintf(stderr, "[%d] -> # of nodes=%d\n", world_rank, nodes);
+
+    return nodes;
+}
+
+/*
+ * Gets ready for a run with the given command line: output, header and seeds.
+ */
+void startRun(int argc, char *argv[], struct params parameters)
+{
+    outputFile = parameters.outputfile;
+    walltime = parameters.walltime;
+    runStart = MPI_Wtime();
+
+    if (world_rank == 0) { // program parameters
+        int i;
+        free(header);
+        header = calloc(1, sizeof(char));
+        for(i=0; i<argc; i++) {
+            header = append(header, argv[i]);
+            header = append(header, " ");
+        }
+    }
+
+    doInitializeRng(argc, argv);
+    ransave(&processStream);
+    if (world_rank == 0 && parameters.shard > 0 && parameters.format == FORMAT_TEXT) // The output of a shard goes right after the previous one
+        header[0] = '\0';
+
+    format = parameters.format;
+    gz = parameters.gz;
+    if (world_rank == 0) {
+        headerBytes = strlen(header);
+        if (format == FORMAT_BIN) { // The text header goes into the binary one, and every shard is a container
+            char *text = header;
+            header = binHeader(parameters.shard > 0 ? "" : text, parameters, &headerBytes);
+            free(text);
+        }
+        outputOffset = headerBytes;
+    }
+
+    if (world_rank == 0 && outputFile == NULL) {
+        long bytes = headerBytes;
+        char *text = gz ? compressOutput(header, headerBytes, gz, &bytes) : header;
+        fwrite(text, sizeof(char), bytes, stdout);
+        fflush(stdout);
+        if (gz)
+            free(text);
+    }
+}
+
+int setup(int argc, char *argv[], struct params parameters)
+{
+    readSettings(parameters);
+    int nodes = initializeMPI(argc, argv);
+    startRun(argc, argv, parameters);
+
+    return nodes;
+}
+
+void teardown() {
+    free(weights);
+    if (nodecomm != MPI_COMM_NULL)
+        MPI_Comm_free(&nodecomm);
+    MPI_Finalize();
+}
+
+void masterWorker(int argc, char *argv[], int howmany, struct params parameters, unsigned int maxsites)
+{
+    int nodes = setup(argc, argv, parameters);
+
+    simulate(nodes, howmany, parameters, maxsites);
+    teardown();
+}
+
+/*
+ * Generates the replicates of a run and writes them out.
+ */
+void simulate(int nodes, int howmany, struct params parameters, unsigned int maxsites)
+{
+    parameters.mp.threads = segmentThreads;
+    recordParameters = parameters;
+
+    if (outputFile != NULL) {
+        if (pilot > 0 && world_size > 1)
+            runPilot(parameters, maxsites, world_rank == 0);
+        fileProcessing(howmany, parameters, maxsites);
+        return;
+    }
+
+    if (writerThread && world_rank == 0)
+        startWriter();
+
+    if (dynamic) {
+        if (pilot > 0 && world_size > 1)
+            runPilot(parameters, maxsites, 0); // rank 0 generates nothing, it only schedules and writes
+        dynamicProcessing(howmany, parameters, maxsites);
+    } else
+        staticProcessing(nodes, howmany, parameters, maxsites);
+
+    stopWriter();
+}
+
+/*
+ * Static mode: howmany is split up-front among nodes and processes, and the output of every node reaches rank 0
+ * through the aggregation tree.
+ */
+void staticProcessing(int nodes, int howmany, struct params parameters, unsigned int maxsites)
+{
+    MPI_Bcast(&nodes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    buildAggregationTree(nodes);
+    if (pilot > 0 && world_size > 1)
+        runPilot(parameters, maxsites, world_rank == 0 || (shm_rank == 0 && world_size != shm_size));
+
+    int nodeSamples = howmany / nodes;
+    int remainingGlobal = howmany % nodes;
+    // A node with a single process has no worker but its node master
+    int workerSamples = shm_size > 1 ? nodeSamples / (shm_size - 1) : 0;
+    int remainingLocal = shm_size > 1 ? nodeSamples % (shm_size - 1) : nodeSamples;
+
+    // Replicates are numbered in rank order, so that every process knows the streams of its samples
+    int samples;
+    if (world_size == shm_size || weights != NULL)
+        samples = replicateShare(howmany);
+    else if (masterMaxNodes > 0 && nodes > masterMaxNodes && shm_size > 1 && node_master == 0 && shm_rank < 2)
+        // Rank 0 only collects the output of many nodes: the next process of its node takes its share
+        samples = world_rank == 0 ? 0 : workerSamples + remainingLocal + remainingGlobal;
+    else if (shm_rank != 0)
+        samples = workerSamples;
+    else
+        samples = remainingLocal + (world_rank == 0 ? remainingGlobal : 0);
+    int first = firstReplicate(world_rank < howmany ? samples : 0);
+
+    // Filter out workers with rank higher than howmany, meaning there are more workers than samples to be generated.
+    if(world_rank < howmany) {
+        if (world_size == shm_size) { // There is only one node
+            long bytes;
+            singleNodeProcessing(samples, first, parameters, maxsites, &bytes);
+        } else {
+            if (world_rank != 0 && shm_rank != 0) {
+                long bytes = 0;
+                char *results = generateSamples(first, samples, parameters, maxsites, &bytes);
+
+                if (world_rank == shm_rank)
+                    printSamples(results, bytes);
+                else { // Hand results over to shm_rank = 0
+                    MPI_Win win;
+                    MPI_Aint node_bytes;
+                    shareNodeResults(results, bytes, &win, &node_bytes);
+                    MPI_Win_free(&win);
+                }
+            } else {
+                if (world_rank != 0 && shm_rank == 0) {
+                    secondaryNodeProcessing(first, samples, nodes, parameters, maxsites);
+                } else
+                    principalMasterProcessing(first, samples, nodes, parameters, maxsites);
+            }
+        }
+    }
+}
+
+/*
+ * Receives the results sent by sendResults from any process.
+ *
+ * @param source rank of the sender in comm
+ * @param bytes size of the results
+ */
+char *readResults(MPI_Comm comm, int *source, long *bytes)
+{
+    MPI_Status status;
+    long offset;
+
+    MPI_Recv(bytes, 1, MPI_LONG, MPI_ANY_SOURCE, RESULTS_TAG, comm, &status);
+    *source = status.MPI_SOURCE;
+
+    char *results = (char *) malloc(*bytes * sizeof(char));
+
+    for (offset = 0; offset < *bytes; offset += MAX_MESSAGE)
+        MPI_Recv(results + offset, *bytes - offset < MAX_MESSAGE ? *bytes - offset : MAX_MESSAGE, MPI_CHAR, *source,
+                 RESULTS_TAG, comm, MPI_STATUS_IGNORE);
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Read [%ld] bytes from worker %d.\n", world_rank, *bytes, *source);
+
+    return results;
+}
+
+/*
+ * Sends results of any size: the size goes first, followed by the results in messages of at most MAX_MESSAGE bytes,
+ * which MPI delivers in order.
+ */
+void sendResults(const char *results, long bytes, int dest, MPI_Comm comm)
+{
+    long offset;
+
+    MPI_Send(&bytes, 1, MPI_LONG, dest, RESULTS_TAG, comm);
+    for (offset = 0; offset < bytes; offset += MAX_MESSAGE)
+        MPI_Send(results + offset, bytes - offset < MAX_MESSAGE ? bytes - offset : MAX_MESSAGE, MPI_CHAR, dest,
+                 RESULTS_TAG, comm);
+}
+
+/*
+ * Generates consecutive replicates, which are laid out in replicate order whatever thread generated them.
+ *
+ * @param first index of the first replicate
+ */
+char *generateSamples(int first, int samples, struct params parameters, unsigned maxsites, long *bytes)
+{
+    char *results, **sampleResults = malloc(sizeof(char *) * samples);
+    int *lengths = malloc(sizeof(int) * samples);
+    int i;
+
+    #pragma omp parallel num_threads(threads)
+    {
+        seedThread();
+
+        #pragma omp for schedule(dynamic)
+        for (i = 0; i < samples; ++i)
+            sampleResults[i] = generateSample(parameters, maxsites, first + i, &lengths[i]);
+    }
+
+    *bytes = 0;
+    for (i = 0; i < samples; i++)
+        *bytes += lengths[i];
+
+    results = malloc(*bytes + 1);
+    *bytes = 0;
+    for (i = 0; i < samples; i++) {
+        memcpy(results + *bytes, sampleResults[i], lengths[i]);
+        *bytes += lengths[i];
+        free(sampleResults[i]);
+    }
+    results[*bytes] = '\0';
+
+    free(sampleResults);
+    free(lengths);
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Generated [%d] samples.\n", world_rank, samples);
+
+    return results;
+}
+
+/*
+ * doInitializeRng - Initializes the Random Number Generator
+ * @argc number of arguments passed to the program
+ * @argv array holding the arguments passed to the program
+ *
+ * Reads the RGN seeds from command arguments and use them as the key of
+ * the counter-based RNG (rand3.c). Every process is seeded the same way:
+ * samples are told apart by their replicate index, not by the process
+ * generating them. The global master appends the seeds to the header.
+ */
+int doInitializeRng(int argc, char *argv[])
+{
+    int arg = 0;
+    int result = 0;
+    unsigned short seedv[3] = { 0x330E, 0xABCD, 0x1234 };
+    char *seedLine;
+
+    ranseed(seedv); // Default seeds, unless given in the command line
+    while(arg < argc){
+        switch(argv[arg++][1]){
+        case 's':
+            if(argv[arg-1][2] == 'e') {
+                seedv[0] = atoi(argv[arg]);
+                seedv[1] = atoi(argv[arg+1]);
+                seedv[2] = atoi(argv[arg+2]);
+                ranseed(seedv);
+
+                if (world_rank == 0) {
+                    asprintf(&seedLine, "\n%d %d %d\n", seedv[0], seedv[1], seedv[2]);
+                    header = append(header, seedLine);
+                    free(seedLine);
+                }
+            }
+            break;
+        default:
+            continue;
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Index of the first replicate of this process, replicates being numbered in rank order (collective).
+ *
+ * @param samples replicates generated by this process
+ */
+int firstReplicate(int samples)
+{
+    int first = 0;
+
+    MPI_Exscan(&samples, &first, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    return world_rank == 0 ? 0 : first; // MPI_Exscan leaves the receive buffer of rank 0 undefined
+}
+
+/*
+ * Falls back to a single thread per process when the MPI library cannot be called from several threads.
+ */
+void checkThreadSupport()
+{
+    int provided;
+
+    MPI_Query_thread(&provided);
+    if (provided < MPI_THREAD_SERIALIZED && threads > 1) {
+        if (world_rank == 0)
+            fprintf(stderr, "The MPI library does not support MPI_THREAD_SERIALIZED, running a single thread per process.\n");
+        threads = 1;
+    }
+}
+
+// **************************************  //
+// SERVER MODE
+// **************************************  //
+
+/*
+ * Server mode (msparsm -server <socket>): MPI, the communicators and the nodes are set up once, and the processes
+ * stay up running whatever is requested through a Unix domain socket, which rank 0 listens on. A client connects and
+ * sends a line with the arguments of a run, as given to msparsm (e.g. "10 100 -t 5 -seeds 1 2 3"); the output of the
+ * run goes back through the connection, which is closed once the run is over. A line "exit" stops the server.
+ *
+ * Requests are served one at a time. Without -o the output is written by rank 0 only, so runs are always scheduled
+ * dynamically.
+ */
+void serve(int argc, char *argv[], unsigned int maxsites)
+{
+    struct params parameters = { 0 };
+    int listener = -1, client = -1, console = -1;
+    int nodes, length, requestArgc, howmany;
+    char *request = NULL, **requestArgv;
+
+    serving = 1;
+    readSettings(parameters);
+    nodes = initializeMPI(argc, argv);
+
+    if (world_rank == 0) {
+        listener = openServerSocket(argv[2]);
+        console = dup(STDOUT_FILENO);
+        signal(SIGPIPE, SIG_IGN); // A client leaving early must not take the server down with it
+    }
+
+    for (;;) {
+        if (world_rank == 0) {
+            do {
+                if (client >= 0)
+                    close(client);
+                client = acceptRequest(listener, argv[0], &request);
+            } while (request == NULL);
+            length = strcmp(request, "exit") == 0 ? 0 : strlen(request) + 1;
+        }
+
+        MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (length == 0)
+            break;
+        if (world_rank != 0)
+            request = malloc(length);
+        MPI_Bcast(request, length, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+        if (diagnose && world_rank == 0)
+            fprintf(stderr, "[%d] -> Serving request: %s\n", world_rank, request);
+
+        requestArgv = splitRequest(argv[0], request, &requestArgc);
+        parameters = getpars(requestArgc, requestArgv, &howmany, 0, 0);
+        readSettings(parameters);
+
+        if (world_rank == 0) { // The output of the run goes to the client
+            fflush(stdout);
+            dup2(client, STDOUT_FILENO);
+        }
+
+        startRun(requestArgc, requestArgv, parameters);
+        simulate(nodes, howmany, parameters, maxsites);
+
+        if (world_rank == 0) {
+            fflush(stdout);
+            dup2(console, STDOUT_FILENO);
+            close(client);
+            client = -1;
+        }
+
+        freepars(&parameters);
+        free(requestArgv);
+        free(request);
+        request = NULL;
+    }
+
+    if (world_rank == 0) {
+        close(client);
+        close(listener);
+        unlink(argv[2]);
+    }
+    free(request);
+    free(header);
+    teardown();
+}
+
+/*
+ * Listens on a Unix domain socket at the given path, replacing whatever socket a previous server left behind.
+ */
+int openServerSocket(const char *path)
+{
+    struct sockaddr_un address = { 0 };
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror(path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (diagnose)
+        fprintf(stderr, "[%d] -> Listening on %s.\n", world_rank, path);
+
+    return listener;
+}
+
+/*
+ * Waits for a client and reads its request, a single line.
+ *
+ * @param request the request, or NULL when it is not a valid command line, in which case the client has been sent
+ *                the complaint of getpars and can be closed
+ *
+ * @return the connection to the client
+ */
+int acceptRequest(int listener, char *program, char **request)
+{
+    int client, size = 0, capacity = 256;
+    ssize_t bytes = 1;
+    char *line = malloc(capacity);
+
+    while ((client = accept(listener, NULL, NULL)) < 0)
+        ;
+
+    while (bytes > 0 && (size == 0 || line[size - 1] != '\n')) {
+        if (size == capacity) {
+            capacity *= 2;
+            line = realloc(line, capacity);
+        }
+        bytes = read(client, line + size, capacity - size);
+        if (bytes > 0)
+            size += bytes;
+    }
+    while (size > 0 && (line[size - 1] == '\n' || line[size - 1] == '\r'))
+        size--;
+    line = realloc(line, size + 1);
+    line[size] = '\0';
+
+    if (strcmp(line, "exit") != 0 && !checkRequest(client, program, line)) {
+        free(line);
+        line = NULL;
+    }
+
+    *request = line;
+    return client;
+}
+
+/*
+ * Parses a request on rank 0. Errors are reported to the client instead of stderr.
+ *
+ * @return 1 if the request is a valid command line, 0 otherwise
+ */
+int checkRequest(int client, char *program, const char *request)
+{
+    int argc, valid, saved;
+    char *line = strdup(request), **argv = splitRequest(program, line, &argc);
+
+    fflush(stderr);
+    saved = dup(STDERR_FILENO);
+    dup2(client, STDERR_FILENO);
+    valid = checkpars(argc, argv);
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+
+    free(argv);
+    free(line);
+    return valid;
+}
+
+/*
+ * Splits a request into a command line, program name first. Arguments point into the request.
+ *
+ * @param argc number of arguments
+ */
+char **splitRequest(char *program, char *request, int *argc)
+{
+    char **argv = malloc(sizeof(char *) * (strlen(request) / 2 + 3)); // (n + 1) / 2 arguments, program and NULL
+    char *argument;
+
+    *argc = 0;
+    argv[(*argc)++] = program;
+    for (argument = strtok(request, " \t"); argument != NULL; argument = strtok(NULL, " \t"))
+        argv[(*argc)++] = argument;
+    argv[*argc] = NULL;
+
+    return argv;
+}
@@ -1,26 +1,91 @@
 #include <mpi.h>
 
-void masterWorker(int argc, char *argv[], int howmany, struct params parameters, int unsigned maxsites);
+// Results of a worker waiting to be streamed to the master
+struct batch {
+    char *data;
+    long bytes;
+    long capacity;
+    int pending; // batches sent and not acknowledged by the master yet
+    char *buffers[2]; // double buffering of messages: one batch is being sent while the other one is filled
+    long capacities[2];
+    int buffer; // buffer being filled
+    int sending[2]; // a send from the buffer may still be in progress
+    MPI_Request requests[2];
+    char *slabs[2]; // halves of the shared window the batch is written into, if any
+    int slab; // slab being filled
+    int slabPending[2]; // slab handed over to the node master and not released yet
+};
+
 void teardown();
-int setup(int argc, char *argv[], int howmany, struct params parameters);
+int setup(int argc, char *argv[], struct params parameters);
+void readSettings(struct params parameters);
+int initializeMPI(int argc, char *argv[]);
+void startRun(int argc, char *argv[], struct params parameters);
+void simulate(int nodes, int howmany, struct params parameters, unsigned int maxsites);
+int openServerSocket(const char *path);
+int acceptRequest(int listener, char *program, char **request);
+int checkRequest(int client, char *program, const char *request);
+char **splitRequest(char *program, char *request, int *argc);
 int doInitializeRng(int argc, char *argv[]);
-char* generateSample(struct params parameters, unsigned int maxsites, int *bytes);
-char *generateSamples(int, struct params, unsigned, int *bytes);
-struct gensam_result gensam(char **gametes, double *probss, double *ptmrca, double *pttot, struct params pars, int* segsites);
-char *append(char *lhs, const char *rhs);
-char *doPrintWorkerResultHeader(int segsites, double probss, struct params paramters, char *treeOutput);
-char *doPrintWorkerResultPositions(int segsites, int output_precision, double *posit);
-char *doPrintWorkerResultGametes(int segsites, int nsam, char **gametes);
-char *readResults(MPI_Comm comm, int* source, int *bytes);
-void initializeSeedMatrix(int argc, char *argv[], int howmany);
-void singleNodeProcessing(int howmany, struct params parameters, unsigned int maxsites, int *bytes);
-void printSamples(char *results, int bytes);
-void secondaryNodeProcessing(int remaining, struct params parameters, unsigned int maxsites);
-void sendResultsToMaster(char *results, int bytes, MPI_Comm comm);
-void principalMasterProcessing(int remaining, int nodes, struct params parameters, unsigned int maxsites);
+char *generateSamples(int first, int samples, struct params, unsigned, long *bytes);
+char *readResults(MPI_Comm comm, int* source, long *bytes);
+void sendResults(const char *results, long bytes, int dest, MPI_Comm comm);
+int firstReplicate(int samples);
+void singleNodeProcessing(int samples, int first, struct params parameters, unsigned int maxsites, long *bytes);
+void printSamples(char *results, long bytes);
+void staticProcessing(int nodes, int howmany, struct params parameters, unsigned int maxsites);
+void secondaryNodeProcessing(int first, int remaining, int nodes, struct params parameters, unsigned int maxsites);
+void principalMasterProcessing(int first, int remaining, int nodes, struct params parameters, unsigned int maxsites);
 int calculateNumberOfNodes();
+int buildAggregationTree(int nodes);
+int firstChild(int node);
+int lastChild(int node, int nodes);
+char *shareNodeResults(char *results, long bytes, MPI_Win *win, MPI_Aint *node_bytes);
+int scheduleReplicates(int first, int howmany, int workers, int sources);
+int chunkSize(int remaining, int workers, int worker);
+int budgetChunk(int chunk, int completed, double since);
+int roundBudget(int round, int produced);
+int batchChunk(int remaining, int produced, long generated);
+char *walltimeFooter(int produced, int howmany);
+int requestWork(int *first);
+void generateScheduledSamples(struct params parameters, unsigned maxsites, struct batch *batch);
+void addToBatch(struct batch *batch, const char *sample, int length);
+void flushBatch(struct batch *batch, int tag);
+void flushSlab(struct batch *batch, int tag);
+char *receiveResults(MPI_Status *status, int *bytes, char **buffer, int *capacity);
+int releaseResults(MPI_Status *status);
+int resultsTag(int bytes);
+void relayNodeResults();
+void writeResults(const char *results, long bytes);
+void startWriter();
+void stopWriter();
+void queueOutput(char *data, long bytes);
+void writeOutput(const char *data, long bytes);
+void *writeQueuedOutput(void *unused);
+int writeFully(int fd, const char *data, long bytes);
+void writeSample(const char *sample, int length);
+void reorderResults(const char *results, long bytes);
+char *frameSample(int index, char *sample, int *length);
+char *compressSample(char *sample, int *length);
+void compressBatch(struct batch *batch);
+char *compressResults(char *results, long *bytes);
+void backOff(int *idle);
+void writeReceived(char **received, MPI_Request *requests, int index, MPI_Status *status);
+void seedThread();
+void runPilot(struct params parameters, unsigned maxsites, int writer);
+int replicateShare(int howmany);
+void checkThreadSupport();
+void dynamicProcessing(int howmany, struct params parameters, unsigned int maxsites);
+void fileProcessing(int howmany, struct params parameters, unsigned int maxsites);
+MPI_File openOutputFile(int resume, int *done, MPI_Offset *offset);
+MPI_Offset writeResultsToFile(MPI_File file, MPI_Offset offset, const char *results, long bytes, MPI_Offset *blockStart);
+void gatherBinIndex(struct batch *batch);
+void indexFile(MPI_File file, MPI_Offset end);
+void indexOutput(const char *records, long bytes);
+void closeOutput(int produced, int howmany);
+void writeCheckpoint(MPI_File file, int done, MPI_Offset offset);
+int readCheckpoint(MPI_Offset *offset);
 
 /* From ms.c*/
 char ** cmatrix(int nsam, int len);
-double ran1();
 int commandlineseed(char **);
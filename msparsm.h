@@ -0,0 +1,61 @@
+/*
+ * libmsparsm - msParSm as a library.
+ *
+ * Replicates are simulated in the calling process and handed to a callback as in-memory arrays, instead of being
+ * printed as ms text. Parameters are given with the same command line as the msparsm executable, e.g.
+ *
+ *     char *argv[] = { "msparsm", "10", "1000", "-t", "100", "-r", "100", "100000", "-seeds", "1", "2", "3" };
+ *     struct msparsm_params *params = msparsm_create_params(12, argv);
+ *     msparsm_simulate(params, 1000, callback, data);
+ *     msparsm_free_params(params);
+ *
+ * The simulation state is kept per thread: different threads can simulate at the same time, each one with its own
+ * parameters. Invalid command lines are reported on stderr and terminate the process, as with the executable.
+ */
+#ifndef MSPARSM_H
+#define MSPARSM_H
+
+struct msparsm_params;
+
+struct msparsm_replicate {
+    int index;          // 0-based index of the replicate, counting from the first msparsm_simulate call
+    int nsam;           // number of haplotypes
+    int segsites;       // number of segregating sites
+    double probss;      // probability of segsites, only with both -s and -t
+    double *positions;  // segsites positions of the segregating sites, on a scale of 0.0 - 1.0
+    char **haplotypes;  // nsam null terminated strings of segsites '0' (ancestral) or '1' (derived) alleles
+    char *trees;        // Newick trees of every segment with -T, NULL otherwise
+};
+
+/*
+ * Called once per replicate. The replicate and its arrays are only valid during the call.
+ *
+ * @return 0 to go on with the next replicate, anything else to stop the simulation
+ */
+typedef int (*msparsm_callback)(const struct msparsm_replicate *replicate, void *data);
+
+/*
+ * Parses an msparsm command line (argv[0] being the program name, argv[1] nsam and argv[2] howmany).
+ *
+ * @return the parameters, or NULL if the command line is not valid, the reason being printed on stderr
+ */
+struct msparsm_params *msparsm_create_params(int argc, char *argv[]);
+
+/*
+ * Simulates howmany replicates (howmany in the command line is ignored), calling back for every one of them.
+ * Successive calls go on with the next replicates; with the same seeds, replicate k is the same as the one the
+ * executable generates.
+ *
+ * @return number of replicates simulated
+ */
+int msparsm_simulate(struct msparsm_params *params, int howmany, msparsm_callback callback, void *data);
+
+/*
+ * Sets the number of threads placing the mutations of the segments of every replicate (1 by default), which only
+ * pays off with many segments, i.e. a high recombination rate. Requires a library built with OpenMP.
+ */
+void msparsm_set_threads(struct msparsm_params *params, int threads);
+
+void msparsm_free_params(struct msparsm_params *params);
+
+#endif
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ms.h"
+#include "msbin.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// **************************************  //
+// THREADS-ONLY BUILD (msparsm-threads)
+// **************************************  //
+// Replaces the MPI layer of mspar.c for runs on a single node: a team of threads takes replicates one at a time from a
+// shared counter and the output goes through a single writer. Same command line and output as msparsm.
+
+int diagnose = 0;         // Used for diagnosing the application.
+long batchSize = 4 << 20; // Threads write their results once a batch reaches this size (MSPARSM_BATCH_SIZE, 0 = unbounded).
+int threads = 1;          // Threads generating samples (MSPARSM_THREADS, every core by default).
+int segmentThreads = 1;   // Threads placing mutations within every sample (MSPARSM_SEGMENT_THREADS).
+struct binindex binIndex; // -format bin: offsets of the records written so far.
+unsigned long long written = 0; // Bytes written so far.
+int gz = 0;               // Compression level of the output (-gz), 0 = uncompressed.
+
+/*
+ * Builds the header (command line and seeds, if any) and seeds the RNG of the calling thread.
+ */
+static char *initializeHeader(int argc, char *argv[])
+{
+    int i;
+    unsigned short seedv[3];
+    char *seedLine, *header = calloc(1, sizeof(char));
+
+    for (i = 0; i < argc; i++) {
+        header = append(header, argv[i]);
+        header = append(header, " ");
+    }
+
+    for (i = 1; i < argc - 3; i++) {
+        if (strcmp(argv[i], "-seeds") == 0) {
+            seedv[0] = atoi(argv[i + 1]);
+            seedv[1] = atoi(argv[i + 2]);
+            seedv[2] = atoi(argv[i + 3]);
+            ranseed(seedv);
+
+            asprintf(&seedLine, "\n%d %d %d\n", seedv[0], seedv[1], seedv[2]);
+            header = append(header, seedLine);
+            free(seedLine);
+        }
+    }
+
+    return header;
+}
+
+/*
+ * Seconds elapsed since some fixed point in the past.
+ */
+static double now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*
+ * Writes a batch out. Only one thread writes at a time, so samples are never interleaved. With -gz, the calling
+ * thread compresses the batch first, so that threads compress their batches concurrently.
+ *
+ * @param records whether the batch is made of binary records, which go into the index
+ */
+static void writeBatch(FILE *output, const char *data, size_t bytes, int records)
+{
+    long length = bytes;
+    char *compressed = NULL;
+
+    if (gz)
+        data = compressed = compressOutput(data, bytes, gz, &length);
+
+    #pragma omp critical(output)
+    {
+        if (records)
+            addBinRecords(&binIndex, data, length, written);
+        fwrite(data, sizeof(char), length, output);
+        fflush(output);
+        written += length;
+    }
+
+    free(compressed);
+}
+
+void serve(int argc, char *argv[], unsigned int maxsites)
+{
+    (void) argc;
+    (void) argv;
+    (void) maxsites;
+    fprintf(stderr, "-server is only available in msparsm, the MPI build\n");
+    exit(1);
+}
+
+void masterWorker(int argc, char *argv[], int howmany, struct params parameters, unsigned int maxsites)
+{
+    int next = 0;
+    int records = parameters.format == FORMAT_BIN;
+    long bytes;
+    char *header, *footer;
+    FILE *output = stdout;
+    struct ranstate stream;
+    double start = now();
+
+    if (getenv("MSPARSM_DIAGNOSE")) diagnose = 1;
+    if (getenv("MSPARSM_BATCH_SIZE") && (batchSize = parseSize(getenv("MSPARSM_BATCH_SIZE"))) < 0) {
+        fprintf(stderr, "MSPARSM_BATCH_SIZE must be a number of bytes, optionally followed by K, M or G\n");
+        exit(1);
+    }
+#ifdef _OPENMP
+    threads = omp_get_num_procs();
+#endif
+    if (getenv("MSPARSM_THREADS")) threads = atoi(getenv("MSPARSM_THREADS"));
+    if (threads < 1) threads = 1;
+    if (getenv("MSPARSM_SEGMENT_THREADS")) segmentThreads = atoi(getenv("MSPARSM_SEGMENT_THREADS"));
+    if (segmentThreads < 1) segmentThreads = 1;
+#ifdef _OPENMP
+    if (threads > 1 && segmentThreads > 1) omp_set_max_active_levels(2);
+#endif
+    parameters.mp.threads = segmentThreads;
+    gz = parameters.gz;
+
+    // Output is written once, so there is nothing to resume from: refuse rather than start over on the output file
+    if (parameters.resume || getenv("MSPARSM_CHECKPOINT")) {
+        fprintf(stderr, "-resume and MSPARSM_CHECKPOINT are only available in msparsm, the MPI build\n");
+        exit(1);
+    }
+
+    if (parameters.outputfile != NULL && (output = fopen(parameters.outputfile, "w")) == NULL) {
+        perror(parameters.outputfile);
+        exit(1);
+    }
+
+    header = initializeHeader(argc, argv);
+    ransave(&stream);
+    if (parameters.shard > 0) // The output of a shard goes right after the previous one
+        header[0] = '\0';
+    bytes = strlen(header);
+    if (records) { // The text header goes into the binary one
+        footer = header;
+        header = binHeader(footer, parameters, &bytes);
+        free(footer);
+    }
+    writeBatch(output, header, bytes, 0);
+    free(header);
+
+    if (diagnose)
+        fprintf(stderr, "[0] -> Generating [%d] samples with [%d] threads.\n", howmany, threads);
+
+    #pragma omp parallel num_threads(threads)
+    {
+        char *sample, *batch = NULL;
+        size_t bytes = 0, capacity = 0;
+        int length, index, samples = 0;
+        double started = now(), elapsed;
+
+        ranrestore(&stream);
+
+        for (;;) {
+            // With a walltime, a thread takes no replicate it is not expected to complete in the time left, going by
+            // its own replicates so far. Replicates taken are always completed, so they are the first ones.
+            if (parameters.walltime > 0) {
+                elapsed = now() - start;
+                if (elapsed >= parameters.walltime
+                    || (samples > 0 && elapsed + (now() - started) / samples > parameters.walltime))
+                    break;
+            }
+
+            #pragma omp atomic capture
+            index = next++;
+
+            if (index >= howmany)
+                break;
+
+            sample = generateSample(parameters, maxsites, index, &length);
+            if (bytes + length > capacity) {
+                capacity = 2 * (bytes + length);
+                batch = realloc(batch, capacity);
+            }
+            memcpy(batch + bytes, sample, length);
+            bytes += length;
+            free(sample);
+            samples++;
+
+            if (batchSize > 0 && bytes >= (size_t) batchSize) {
+                writeBatch(output, batch, bytes, records);
+                bytes = 0;
+            }
+        }
+
+        if (bytes > 0)
+            writeBatch(output, batch, bytes, records);
+        free(batch);
+
+        if (diagnose) {
+#ifdef _OPENMP
+            fprintf(stderr, "[%d] -> Generated [%d] samples.\n", omp_get_thread_num(), samples);
+#else
+            fprintf(stderr, "[0] -> Generated [%d] samples.\n", samples);
+#endif
+        }
+    }
+
+    if (records) {
+        footer = binIndexFooter(&binIndex, &bytes);
+        writeBatch(output, footer, bytes, 0);
+        free(footer);
+    } else if (parameters.walltime > 0) {
+        asprintf(&footer, "\nwalltime: %d of %d replicates\n", next < howmany ? next : howmany, howmany);
+        writeBatch(output, footer, strlen(footer), 0);
+        free(footer);
+    }
+    if (gz) {
+        footer = compressedEnd(&bytes);
+        fwrite(footer, sizeof(char), bytes, output);
+        free(footer);
+    }
+
+    if (output != stdout)
+        fclose(output);
+}
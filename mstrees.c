@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "ms.h"
+
+// **************************************  //
+// GENE TREES (-T)
+// **************************************  //
+// Tree of a segment as Newick text, exactly as ms prints it, or as a binary tree (-T bin). Lengths are worked out
+// first, so that gensam writes the trees of all the segments of a sample into a single buffer. Trees are walked with
+// an explicit stack, since their depth grows with nsam.
+//
+// Binary tree of a segment, all fields 4 bytes wide:
+//     uint32   sites of the segment
+//     uint32   parent of every node but the root, nodes 0 to 2*nsam-3 (samples are nodes 0 to nsam-1)
+//     float    time of every internal node, nodes nsam to 2*nsam-2 (samples are at time 0)
+
+static int decimalLength(long long value)
+{
+    int length = 1;
+
+    while (value >= 10) {
+        value /= 10;
+        length++;
+    }
+    return length;
+}
+
+static char *putDecimal(char *out, long long value)
+{
+    int i, length = decimalLength(value);
+
+    for (i = length - 1; i >= 0; i--, value /= 10)
+        out[i] = '0' + value % 10;
+    return out + length;
+}
+
+/*
+ * Branch length in thousandths, as "%5.3lf" rounds it, or -1 when it is too long (or negative) for a long long.
+ * Times are floats, so branch * 1000 is exact in a double and nearbyint rounds ties to even, as printf does.
+ */
+static long long thousandths(double branch)
+{
+    double scaled = nearbyint(branch * 1000.0);
+
+    return scaled >= 0.0 && scaled < 1e15 ? (long long) scaled : -1;
+}
+
+static int branchLength(double branch)
+{
+    long long value = thousandths(branch);
+
+    return value < 0 ? snprintf(NULL, 0, "%5.3lf", branch) : decimalLength(value / 1000) + 4;
+}
+
+static char *putBranch(char *out, double branch)
+{
+    long long value = thousandths(branch);
+
+    if (value < 0)
+        return out + sprintf(out, "%5.3lf", branch);
+
+    out = putDecimal(out, value / 1000);
+    *out++ = '.';
+    out[2] = '0' + value % 10;
+    out[1] = '0' + value / 10 % 10;
+    out[0] = '0' + value / 100 % 10;
+    return out + 3;
+}
+
+/*
+ * Length of the Newick text of a tree. Every node adds the same characters wherever it lies in the tree, so the
+ * nodes are simply added up.
+ *
+ * @param sites sites of the segment, printed before the tree as "[sites]", or 0 to leave them out
+ */
+long newickLength(struct node *ptree, int nsam, int sites)
+{
+    int i;
+    long length = sites > 0 ? decimalLength(sites) + 2 : 0;
+
+    for (i = 0; i < nsam; i++) // "i:branch"
+        length += decimalLength(i + 1) + 1 + branchLength((ptree + (ptree + i)->abv)->time);
+    for (; i < 2 * nsam - 1; i++) { // "(" "," "):branch", or "(" "," ");\n" for the root
+        if ((ptree + i)->abv == 0)
+            length += 5;
+        else
+            length += 4 + branchLength((ptree + (ptree + i)->abv)->time - (ptree + i)->time);
+    }
+    return length;
+}
+
+/*
+ * Writes the Newick text of a tree, of newickLength characters.
+ *
+ * @param sites sites of the segment, printed before the tree as "[sites]", or 0 to leave them out
+ *
+ * @return the end of the text
+ */
+char *putNewick(char *out, struct node *ptree, int nsam, int sites)
+{
+    int i, node, *descl, *descr, *stack, top = 0;
+    double branch;
+
+    // Children of every node, the first one found on the left; the stack holds nodes to print (>= 0), commas (-1)
+    // and the closing of internal nodes (-2 - node)
+    descl = malloc(sizeof(int) * (2 * nsam - 1) * 4);
+    descr = descl + 2 * nsam - 1;
+    stack = descr + 2 * nsam - 1;
+    for (i = 0; i < 2 * nsam - 1; i++)
+        descl[i] = descr[i] = -1;
+    for (i = 0; i < 2 * nsam - 2; i++) {
+        if (descl[(ptree + i)->abv] == -1)
+            descl[(ptree + i)->abv] = i;
+        else
+            descr[(ptree + i)->abv] = i;
+    }
+
+    if (sites > 0) {
+        *out++ = '[';
+        out = putDecimal(out, sites);
+        *out++ = ']';
+    }
+
+    stack[top++] = 2 * nsam - 2;
+    while (top > 0) {
+        node = stack[--top];
+        if (node == -1) {
+            *out++ = ',';
+        } else if (node < -1) {
+            node = -2 - node;
+            if ((ptree + node)->abv == 0) {
+                memcpy(out, ");\n", 3);
+                out += 3;
+            } else {
+                branch = (ptree + (ptree + node)->abv)->time - (ptree + node)->time;
+                *out++ = ')';
+                *out++ = ':';
+                out = putBranch(out, branch);
+            }
+        } else if (descl[node] == -1) {
+            out = putDecimal(out, node + 1);
+            *out++ = ':';
+            out = putBranch(out, (ptree + (ptree + node)->abv)->time);
+        } else {
+            *out++ = '(';
+            stack[top++] = -2 - node;
+            stack[top++] = descr[node];
+            stack[top++] = -1;
+            stack[top++] = descl[node];
+        }
+    }
+
+    free(descl);
+    return out;
+}
+
+long binaryTreeLength(int nsam)
+{
+    return sizeof(int) + sizeof(int) * (2 * nsam - 2) + sizeof(float) * (nsam - 1);
+}
+
+/*
+ * Writes the binary tree of a segment, of binaryTreeLength bytes.
+ *
+ * @return the end of the tree
+ */
+char *putBinaryTree(char *out, struct node *ptree, int nsam, int sites)
+{
+    int i;
+
+    memcpy(out, &sites, sizeof(int));
+    out += sizeof(int);
+    for (i = 0; i < 2 * nsam - 2; i++, out += sizeof(int))
+        memcpy(out, &(ptree + i)->abv, sizeof(int));
+    for (i = nsam; i < 2 * nsam - 1; i++, out += sizeof(float))
+        memcpy(out, &(ptree + i)->time, sizeof(float));
+    return out;
+}
+
+/*
+ * Reads a binary tree back into the 2*nsam-1 nodes of ptree.
+ *
+ * @return the end of the tree
+ */
+const char *getBinaryTree(const char *in, struct node *ptree, int nsam, int *sites)
+{
+    int i;
+
+    memset(ptree, 0, sizeof(struct node) * (2 * nsam - 1));
+    memcpy(sites, in, sizeof(int));
+    in += sizeof(int);
+    for (i = 0; i < 2 * nsam - 2; i++, in += sizeof(int))
+        memcpy(&(ptree + i)->abv, in, sizeof(int));
+    for (i = nsam; i < 2 * nsam - 1; i++, in += sizeof(float))
+        memcpy(&(ptree + i)->time, in, sizeof(float));
+    return in;
+}
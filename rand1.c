@@ -1,20 +1,98 @@
-/*  Link in this file for random number generation using drand48() */
+/*  Link in this file for random number generation using erand48(), instead of rand3.c */
+/*  Every thread draws from its own erand48() state. Every replicate, and every substream within it, starts from a
+    state hashed from the seeds and its index, so that replicate k is the same sequence whichever thread or process
+    generates it, as with rand3.c (the sequences themselves differ from those of rand3.c). */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include "ms.h"
+
+/* state of the calling thread: the seeds are the key, ctr[1] the substream of the replicate ctr[2..3]; the erand48()
+   state itself is kept in xsubi while drawing, and in out[0..2] when saved */
+static __thread struct ranstate state = { { 0xABCD330E, 0x1234 }, { 0, 0, 0, 0 }, { 0x330E, 0xABCD, 0x1234, 0 }, 0 } ;
+static __thread unsigned short xsubi[3] = { 0x330E, 0xABCD, 0x1234 } ;  /* default drand48() state */
+
+/* splitmix64 finalizer, spreading close indices over far apart states */
+	static uint64_t
+mix( uint64_t x )
+{
+	x ^= x >> 30 ;
+	x *= 0xBF58476D1CE4E5B9ull ;
+	x ^= x >> 27 ;
+	x *= 0x94D049BB133111EBull ;
+	return( x ^ (x >> 31) );
+}
+
+/* erand48() state of the first draw of the current substream */
+	static void
+startstream( void )
+{
+	uint64_t x ;
+
+	x = mix( ((uint64_t) state.key[1] << 32 | state.key[0]) ^ mix( (uint64_t) state.ctr[3] << 32 | state.ctr[2] )
+	         ^ mix( state.ctr[1] + 0x9E3779B97F4A7C15ull ) );
+	xsubi[0] = (unsigned short) x ;
+	xsubi[1] = (unsigned short) (x >> 16) ;
+	xsubi[2] = (unsigned short) (x >> 32) ;
+}
 
          double
 ran1()
 {
-        double drand48();
-        return( drand48() );
-}               
+        return( erand48( xsubi ) );
+}
+
+/* the seeds become the key of the calling thread, which starts over at replicate 0 */
+	void
+ranseed( unsigned short seedv[3] )
+{
+	state.key[0] = (uint32_t) seedv[0] | (uint32_t) seedv[1] << 16 ;
+	state.key[1] = seedv[2] ;
+	ranstream( 0 );
+}
+
+/* first draw of the replicate of the given index */
+	void
+ranstream( unsigned long replicate )
+{
+	state.ctr[1] = 0 ;
+	state.ctr[2] = (uint32_t) replicate ;
+	state.ctr[3] = (uint32_t) ( (unsigned long long) replicate >> 32 ) ;
+	startstream();
+}
+
+/* first draw of a substream of the current replicate, substream 0 being the one ranstream() starts */
+	void
+ransubstream( unsigned int substream )
+{
+	state.ctr[1] = substream ;
+	startstream();
+}
+
+	void
+ransave( struct ranstate *saved )
+{
+	state.out[0] = xsubi[0] ;
+	state.out[1] = xsubi[1] ;
+	state.out[2] = xsubi[2] ;
+	*saved = state ;
+}
+
+	void
+ranrestore( const struct ranstate *saved )
+{
+	state = *saved ;
+	xsubi[0] = state.out[0] ;
+	xsubi[1] = state.out[1] ;
+	xsubi[2] = state.out[2] ;
+}
 
 
 	void seedit( char *flag )
 {
 	FILE *fopen(), *pfseed;
-	unsigned short seedv[3], seedv2[3],  *seed48(), *pseed ;
+	unsigned short seedv[3], seedv2[3] ;
 	int i;
 
 	if( flag[0] == 's' ) {
@@ -30,14 +108,14 @@ ran1()
 		   }
 	       fclose( pfseed);
 	   }
-	   seed48( seedv );   
+	   ranseed( seedv );   
 
        printf("\n%d %d %d\n", seedv[0], seedv[1], seedv[2] );    
 	}
 	else {
+	     /* the next run goes on with new seeds, drawn from the current stream */
 	     pfseed = fopen("seedms","w");
-         pseed = seed48(seedv);
-         fprintf(pfseed,"%d %d %d\n",pseed[0], pseed[1],pseed[2]);   
+         fprintf(pfseed,"%d %d %d\n", (int)(ran1()*65536), (int)(ran1()*65536), (int)(ran1()*65536) );
 		fclose( pfseed) ;  /*  Added  8 Sept 2014, thanks to Feng Gao */ 
 	}
 }
@@ -45,14 +123,14 @@ ran1()
 	int
 commandlineseed( char **seeds)
 {
-	unsigned short seedv[3], *seed48();
+	unsigned short seedv[3];
 
 	seedv[0] = atoi( seeds[0] );
 	seedv[1] = atoi( seeds[1] );
 	seedv[2] = atoi( seeds[2] );
 	printf("\n%d %d %d\n", seedv[0], seedv[1], seedv[2] );    
 
-	seed48(seedv);
+	ranseed(seedv);
 	return(3);
 }
 
@@ -0,0 +1,141 @@
+/*  Link in this file for counter-based random number generation (Philox4x32-10). */
+/*  Draws are a function of the seeds (the key) and of a counter made of the replicate, a substream within it and the
+    position in the substream, instead of a state carried from draw to draw. Replicate k is then the same sequence
+    whichever thread, process or run generates it. See Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+    SC'11. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "ms.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+/* state of the calling thread: ctr[0] counts blocks within the substream ctr[1] of the replicate ctr[2..3] */
+static __thread struct ranstate state = { { 0xABCD330E, 0x1234 }, { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, 4 } ;
+
+	static void
+philox( const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4] )
+{
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3], k0 = key[0], k1 = key[1] ;
+	uint64_t p0, p1 ;
+	int round ;
+
+	for( round = 0; round < 10; round++ ) {
+		p0 = (uint64_t) PHILOX_M0 * c0 ;
+		p1 = (uint64_t) PHILOX_M1 * c2 ;
+		c0 = (uint32_t)( p1 >> 32 ) ^ c1 ^ k0 ;
+		c2 = (uint32_t)( p0 >> 32 ) ^ c3 ^ k1 ;
+		c1 = (uint32_t) p1 ;
+		c3 = (uint32_t) p0 ;
+		k0 += PHILOX_W0 ;
+		k1 += PHILOX_W1 ;
+	}
+	out[0] = c0 ; out[1] = c1 ; out[2] = c2 ; out[3] = c3 ;
+}
+
+/* uniform deviate in [0,1) with 53 random bits, two words of a block each */
+         double
+ran1()
+{
+	double x ;
+
+	if( state.used == 4 ) {
+		philox( state.ctr, state.key, state.out );
+		state.ctr[0]++ ;
+		state.used = 0 ;
+	}
+	x = ( (state.out[state.used] >> 5) * 67108864.0 + (state.out[state.used+1] >> 6) ) * ( 1.0 / 9007199254740992.0 ) ;
+	state.used += 2 ;
+	return( x );
+}
+
+/* the seeds become the key of the calling thread, which starts over at replicate 0 */
+	void
+ranseed( unsigned short seedv[3] )
+{
+	state.key[0] = (uint32_t) seedv[0] | (uint32_t) seedv[1] << 16 ;
+	state.key[1] = seedv[2] ;
+	ranstream( 0 );
+}
+
+/* first draw of the replicate of the given index */
+	void
+ranstream( unsigned long replicate )
+{
+	state.ctr[0] = 0 ;
+	state.ctr[1] = 0 ;
+	state.ctr[2] = (uint32_t) replicate ;
+	state.ctr[3] = (uint32_t) ( (unsigned long long) replicate >> 32 ) ;
+	state.used = 4 ;
+}
+
+/* first draw of a substream of the current replicate, substream 0 being the one ranstream() starts */
+	void
+ransubstream( unsigned int substream )
+{
+	state.ctr[0] = 0 ;
+	state.ctr[1] = substream ;
+	state.used = 4 ;
+}
+
+	void
+ransave( struct ranstate *saved )
+{
+	*saved = state ;
+}
+
+	void
+ranrestore( const struct ranstate *saved )
+{
+	state = *saved ;
+}
+
+
+	void seedit( char *flag )
+{
+	FILE *fopen(), *pfseed;
+	unsigned short seedv[3], seedv2[3] ;
+	int i;
+
+	if( flag[0] == 's' ) {
+	   pfseed = fopen("seedms","r");
+	   if( pfseed == NULL ) {
+           seedv[0] = 3579 ; seedv[1] = 27011; seedv[2] = 59243;
+	   }
+	   else {
+	       seedv2[0] = 3579; seedv2[1] = 27011; seedv2[2] = 59243;
+           for(i=0;i<3;i++){
+		       if(  fscanf(pfseed," %hd",seedv+i) < 1 )
+		            seedv[i] = seedv2[i] ;
+		   }
+	       fclose( pfseed);
+	   }
+	   ranseed( seedv );
+
+       printf("\n%d %d %d\n", seedv[0], seedv[1], seedv[2] );
+	}
+	else {
+	     /* the next run goes on with new seeds, drawn from the current stream */
+	     pfseed = fopen("seedms","w");
+         fprintf(pfseed,"%d %d %d\n", (int)(ran1()*65536), (int)(ran1()*65536), (int)(ran1()*65536) );
+		fclose( pfseed) ;
+	}
+}
+
+	int
+commandlineseed( char **seeds)
+{
+	unsigned short seedv[3];
+
+	seedv[0] = atoi( seeds[0] );
+	seedv[1] = atoi( seeds[1] );
+	seedv[2] = atoi( seeds[2] );
+	printf("\n%d %d %d\n", seedv[0], seedv[1], seedv[2] );
+
+	ranseed(seedv);
+	return(3);
+}